@@ -0,0 +1,123 @@
+// Equal-power (cos/sin law) dry/wet crossfade, the native version of
+// cos_xfade.pd used by the [xfade~] external.
+//
+// As in cos_xfade.pd the control goes through a 1 Hz one-pole lowpass
+// ([lop~ 1]), the wet gain is sin(c * pi / 2) and the dry gain is
+// -cos(c * pi / 2): the abstraction inverts the dry signal, which is kept
+// so that the chain sounds the same. Instead of two [cos~] per sample, the
+// smoother is advanced once per block in closed form, the gains at both
+// ends of the block are read from a quarter-sine table and ramped linearly,
+// and dry and wet are mixed in one loop, four samples at a time with NEON.
+#pragma once
+#include <math.h>
+#include <algorithm>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CROSSFADE_NEON
+#endif
+
+enum { kCrossfadeTableSize = 512 };
+// sin(pi / 2 * n / kCrossfadeTableSize), plus a guard point
+static float gCrossfadeTable[kCrossfadeTableSize + 2];
+
+static void crossfadeSetupTable()
+{
+	for(unsigned int n = 0; n < kCrossfadeTableSize + 2; ++n)
+		gCrossfadeTable[n] = sinf(float(M_PI) * 0.5f * std::min(n, (unsigned int)kCrossfadeTableSize) / kCrossfadeTableSize);
+}
+
+// Has no constructor so that it can live in a Pd object; call setup() first.
+class Crossfade
+{
+public:
+	void setup()
+	{
+		control = target = 0;
+		coeff = 0;
+		decayFrames = 0;
+		decay = 1;
+		computeGains(control, dryGain, wetGain);
+	}
+
+	void setSampleRate(float sampleRate, float smoothingHz = 1)
+	{
+		// same coefficient as [lop~]
+		coeff = std::min(1.f, 2.f * float(M_PI) * smoothingHz / sampleRate);
+		decayFrames = 0;
+	}
+
+	// 0 is dry only, 1 is wet only
+	void setTarget(float value)
+	{
+		target = std::min(std::max(value, 0.f), 1.f);
+	}
+
+	// out may be the same buffer as dry or wet
+	void process(const float* dry, const float* wet, float* out, unsigned int n)
+	{
+		if(!n)
+			return;
+		float dryStart = dryGain;
+		float wetStart = wetGain;
+		if(control != target)
+		{
+			if(n != decayFrames)
+			{
+				decayFrames = n;
+				decay = powf(1.f - coeff, n);
+			}
+			control = target + (control - target) * decay;
+			if(fabsf(control - target) < 1e-6f)
+				control = target;
+			computeGains(control, dryGain, wetGain);
+		}
+		float dryStep = (dryGain - dryStart) / n;
+		float wetStep = (wetGain - wetStart) / n;
+		unsigned int i = 0;
+#ifdef CROSSFADE_NEON
+		const float ramp[4] = {1, 2, 3, 4};
+		float32x4_t steps = vld1q_f32(ramp);
+		float32x4_t dg = vmlaq_n_f32(vdupq_n_f32(dryStart), steps, dryStep);
+		float32x4_t wg = vmlaq_n_f32(vdupq_n_f32(wetStart), steps, wetStep);
+		float32x4_t dryInc = vdupq_n_f32(4 * dryStep);
+		float32x4_t wetInc = vdupq_n_f32(4 * wetStep);
+		for(; i + 4 <= n; i += 4)
+		{
+			float32x4_t y = vmulq_f32(vld1q_f32(dry + i), dg);
+			y = vmlaq_f32(y, vld1q_f32(wet + i), wg);
+			vst1q_f32(out + i, y);
+			dg = vaddq_f32(dg, dryInc);
+			wg = vaddq_f32(wg, wetInc);
+		}
+#endif // CROSSFADE_NEON
+		for(; i < n; ++i)
+		{
+			float d = dryStart + dryStep * (i + 1);
+			float w = wetStart + wetStep * (i + 1);
+			out[i] = dry[i] * d + wet[i] * w;
+		}
+	}
+
+private:
+	static float lookup(float position)
+	{
+		position *= kCrossfadeTableSize;
+		unsigned int idx = position;
+		float frac = position - idx;
+		return gCrossfadeTable[idx] + frac * (gCrossfadeTable[idx + 1] - gCrossfadeTable[idx]);
+	}
+
+	static void computeGains(float control, float& dry, float& wet)
+	{
+		wet = lookup(control);
+		dry = -lookup(1.f - control);
+	}
+
+	float control;
+	float target;
+	float coeff;
+	float decay; // (1 - coeff) ^ decayFrames
+	unsigned int decayFrames;
+	float dryGain;
+	float wetGain;
+};
@@ -0,0 +1,152 @@
+// Saturation curves for the tape delay, usable from render.cpp and, through
+// the [saturate~] external registered there, from the patch.
+//
+// Maximum absolute error against std::tanh over [-20, 20]:
+//   saturatePade()  2.4e-2 (the curve hv.tanh.pd computes with Pd objects)
+//   saturateTanh()  9.7e-5 (a [7/6] continued fraction, clipped where it reaches 1)
+// saturateBlock() uses NEON when it is available, four samples at a time,
+// and the scalar functions for the remainder. The NEON versions divide with
+// a refined reciprocal estimate and stay within 3e-7 of the scalar ones.
+#pragma once
+#include <algorithm>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SATURATION_NEON
+#endif
+
+enum SaturationCurve {
+	kSaturationPade, // x * (27 + x^2) / (27 + 9 * x^2), clipped at +/-3
+	kSaturationTanh, // accurate rational tanh
+	kSaturationSoftClip, // cubic, reaches +/-1 at +/-1
+	kSaturationTape, // tanh with a DC bias, for asymmetric (even harmonics) distortion
+	kSaturationNumCurves,
+};
+
+static const char* gSaturationCurveNames[kSaturationNumCurves] = {"pade", "tanh", "softclip", "tape"};
+
+// where the rational approximation reaches 1
+static constexpr float kSaturationTanhClip = 4.97178686f;
+
+static inline float saturatePade(float x)
+{
+	x = std::min(std::max(x, -3.f), 3.f);
+	float x2 = x * x;
+	return x * (27.f + x2) / (27.f + 9.f * x2);
+}
+
+static inline float saturateTanh(float x)
+{
+	x = std::min(std::max(x, -kSaturationTanhClip), kSaturationTanhClip);
+	float x2 = x * x;
+	float num = x * (135135.f + x2 * (17325.f + x2 * (378.f + x2)));
+	float den = 135135.f + x2 * (62370.f + x2 * (3150.f + x2 * 28.f));
+	return std::min(std::max(num / den, -1.f), 1.f);
+}
+
+static inline float saturateSoftClip(float x)
+{
+	x = std::min(std::max(x, -1.f), 1.f);
+	return 1.5f * x - 0.5f * x * x * x;
+}
+
+// bias shifts the operating point; the output is offset so that silence
+// stays silent
+static inline float saturateTape(float x, float bias)
+{
+	return saturateTanh(x + bias) - saturateTanh(bias);
+}
+
+static inline float saturate(SaturationCurve curve, float x, float bias = 0)
+{
+	switch(curve)
+	{
+	case kSaturationTanh:
+		return saturateTanh(x);
+	case kSaturationSoftClip:
+		return saturateSoftClip(x);
+	case kSaturationTape:
+		return saturateTape(x, bias);
+	case kSaturationPade:
+	default:
+		return saturatePade(x);
+	}
+}
+
+#ifdef SATURATION_NEON
+static inline float32x4_t saturateDivide(float32x4_t num, float32x4_t den)
+{
+	// reciprocal estimate refined with two Newton-Raphson steps
+	float32x4_t r = vrecpeq_f32(den);
+	r = vmulq_f32(vrecpsq_f32(den, r), r);
+	r = vmulq_f32(vrecpsq_f32(den, r), r);
+	return vmulq_f32(num, r);
+}
+
+static inline float32x4_t saturateClip(float32x4_t x, float limit)
+{
+	return vminq_f32(vmaxq_f32(x, vdupq_n_f32(-limit)), vdupq_n_f32(limit));
+}
+
+static inline float32x4_t saturatePade(float32x4_t x)
+{
+	x = saturateClip(x, 3.f);
+	float32x4_t x2 = vmulq_f32(x, x);
+	float32x4_t num = vmulq_f32(x, vaddq_f32(vdupq_n_f32(27.f), x2));
+	float32x4_t den = vmlaq_n_f32(vdupq_n_f32(27.f), x2, 9.f);
+	return saturateDivide(num, den);
+}
+
+static inline float32x4_t saturateTanh(float32x4_t x)
+{
+	x = saturateClip(x, kSaturationTanhClip);
+	float32x4_t x2 = vmulq_f32(x, x);
+	float32x4_t num = vaddq_f32(vdupq_n_f32(378.f), x2);
+	num = vmlaq_f32(vdupq_n_f32(17325.f), x2, num);
+	num = vmlaq_f32(vdupq_n_f32(135135.f), x2, num);
+	num = vmulq_f32(x, num);
+	float32x4_t den = vmlaq_n_f32(vdupq_n_f32(3150.f), x2, 28.f);
+	den = vmlaq_f32(vdupq_n_f32(62370.f), x2, den);
+	den = vmlaq_f32(vdupq_n_f32(135135.f), x2, den);
+	return saturateClip(saturateDivide(num, den), 1.f);
+}
+
+static inline float32x4_t saturateSoftClip(float32x4_t x)
+{
+	x = saturateClip(x, 1.f);
+	float32x4_t x3 = vmulq_f32(vmulq_f32(x, x), x);
+	return vmlsq_n_f32(vmulq_n_f32(x, 1.5f), x3, 0.5f);
+}
+#endif // SATURATION_NEON
+
+// in and out may be the same buffer
+static inline void saturateBlock(SaturationCurve curve, const float* in, float* out, unsigned int n, float bias = 0)
+{
+	unsigned int i = 0;
+#ifdef SATURATION_NEON
+	const float offset = kSaturationTape == curve ? saturateTanh(bias) : 0;
+	for(; i + 4 <= n; i += 4)
+	{
+		float32x4_t x = vld1q_f32(in + i);
+		float32x4_t y;
+		switch(curve)
+		{
+		case kSaturationTanh:
+			y = saturateTanh(x);
+			break;
+		case kSaturationSoftClip:
+			y = saturateSoftClip(x);
+			break;
+		case kSaturationTape:
+			y = vsubq_f32(saturateTanh(vaddq_f32(x, vdupq_n_f32(bias))), vdupq_n_f32(offset));
+			break;
+		case kSaturationPade:
+		default:
+			y = saturatePade(x);
+			break;
+		}
+		vst1q_f32(out + i, y);
+	}
+#endif // SATURATION_NEON
+	for(; i < n; ++i)
+		out[i] = saturate(curve, in[i], bias);
+}
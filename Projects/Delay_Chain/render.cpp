@@ -12,6 +12,9 @@
 #define BELA_LIBPD_TRILL
 #define BELA_LIBPD_GUI
 #define BELA_LIBPD_SERIAL
+#define BELA_LIBPD_OLED
+// Not enabled by default, as it needs libpd built with PDINSTANCE and PDTHREADS:
+// #define BELA_LIBPD_PIPELINE
 
 #ifdef BELA_LIBPD_DISABLE_SCOPE
 #undef BELA_LIBPD_SCOPE
@@ -25,25 +28,421 @@
 #ifdef BELA_LIBPD_DISABLE_GUI
 #undef BELA_LIBPD_GUI
 #endif // BELA_LIBPD_DISABLE_GUI
+#ifdef BELA_LIBPD_DISABLE_OLED
+#undef BELA_LIBPD_OLED
+#endif // BELA_LIBPD_DISABLE_OLED
+// With a libpd built with PDINSTANCE and PDTHREADS, [; bela_loadPatch <file>(
+// opens the new patch in a second instance and crossfades to it. Otherwise
+// the output fades out while the patch is swapped.
+#if defined(PDINSTANCE) && defined(PDTHREADS)
+#define BELA_LIBPD_SWAP_INSTANCES
+#endif // PDINSTANCE && PDTHREADS
 
 #define PD_THREADED_IO
 #include <libraries/libpd/libpd.h>
 #include <DigitalChannelManager.h>
 #include <stdio.h>
+#include "Saturation.h"
+#include "Oversampler.h"
+#include "Crossfade.h"
 
 #ifdef BELA_LIBPD_MIDI
 #include <libraries/Midi/Midi.h>
+#include <atomic>
+#include <algorithm>
+#include <libraries/Pipe/Pipe.h>
+#include <math.h>
+#include <time.h>
 #endif // BELA_LIBPD_MIDI
 #ifdef BELA_LIBPD_SCOPE
 #include <libraries/Scope/Scope.h>
+#include <libraries/Pipe/Pipe.h>
+#include <atomic>
+#include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <fstream>
 #endif // BELA_LIBPD_SCOPE
 #include <string>
 #include <sstream>
 #include <string.h>
 #include <vector>
+#include <time.h>
+#include <atomic>
 
 #include <libraries/Encoder/Encoder.h>
 
+// Preallocated memory for the variable-length messages handled on the audio
+// thread (Gui and serial pipe messages, lists sent to bela_guiOut), whose
+// sizes come from pipe headers or from the patch and therefore have to be
+// checked rather than put on the stack. Each user has its own slot, as they
+// can be nested (e.g.: a serial message causing a bela_guiOut list).
+// The memory is touched in setup() so that render() never page faults on it.
+typedef enum {
+	kRtScratchGui,
+	kRtScratchSerial,
+	kRtScratchSerialOut,
+	kRtScratchList,
+	kRtScratchNumSlots,
+} RtScratchSlot;
+class RtScratch
+{
+public:
+	enum { kSlotSize = 16384 };
+	void setup()
+	{
+		memory.resize(kRtScratchNumSlots * kSlotSize / sizeof(memory[0]));
+		memset(memory.data(), 0, memory.size() * sizeof(memory[0]));
+	}
+	// returns nullptr if count elements do not fit in a slot
+	template <typename T>
+	T* get(RtScratchSlot slot, size_t count)
+	{
+		if(memory.empty() || count > capacity<T>())
+			return nullptr;
+		return (T*)((char*)memory.data() + slot * kSlotSize);
+	}
+	template <typename T>
+	static constexpr size_t capacity()
+	{
+		return kSlotSize / sizeof(T);
+	}
+private:
+	std::vector<uint64_t> memory;
+};
+static RtScratch gRtScratch;
+
+// Lets the audio thread take over some state from another thread without
+// ever waiting for it: the other thread wraps its accesses in enter() and
+// leave() (and skips them if enter() fails), the audio thread owns the state
+// between a successful tryLock() and unlock(), and tries again later if it
+// fails.
+class RtTryLock
+{
+public:
+	bool enter()
+	{
+		++busy;
+		if(locked)
+		{
+			--busy;
+			return false;
+		}
+		return true;
+	}
+	void leave()
+	{
+		--busy;
+	}
+	bool tryLock()
+	{
+		locked = true;
+		if(busy)
+		{
+			locked = false;
+			return false;
+		}
+		return true;
+	}
+	void unlock()
+	{
+		locked = false;
+	}
+private:
+	std::atomic<int> busy{0};
+	std::atomic<bool> locked{false};
+};
+// held by the Gui thread while it uses gGui.controlKeys, gGui.controlIds and
+// the GuiArrayBuffers, and by readTouchSensors() while it uses gTrill.polled
+static RtTryLock gGuiControlsLock;
+static RtTryLock gTrillLock;
+
+// Receivers that the hooks below respond to. libpd calls the hooks with the
+// s_name of the symbol a receiver was bound to, so once a receiver has been
+// bound through gHooks.bind() it can be identified by looking up that
+// pointer instead of comparing strings.
+enum HookReceiver {
+	kHookNone = 0,
+	kHookDigitalOut, // arg is the digital channel
+	kHookSetDigital,
+	kHookControl,
+	kHookSetMidi,
+	kHookMidiClockSync,
+	kHookMidiLearn,
+	kHookGuiOut,
+	kHookGuiTelemetry,
+	kHookSetGui,
+	kHookSerialOut,
+	kHookSetSerial,
+	kHookSetTrill,
+	kHookSetScope,
+	kHookSetMultiplexer,
+	kHookLoadPatch,
+	kHookPipelineForward, // to _stage2.pd, see pipelineForward()
+	kHookOledParam, // arg is the OledState parameter index
+	kHookOledExpSel, // arg is the OledState expression selector index
+	kHookOledPage, // arg is the index in gOledPages
+	kHookOledDesel,
+	kHookOledNewLength,
+	kHookOledLoopOnOff,
+	kHookOledNewCycle,
+	kHookOledStopLooping,
+	kHookOledExpIn,
+	kHookOledExpOut,
+};
+struct HookEntry
+{
+	const char* name;
+	uint16_t receiver;
+	uint16_t arg;
+};
+class HookTable
+{
+public:
+	// binds the receiver in Pd and records what it is for
+	void bind(const char* name, HookReceiver receiver, unsigned int arg = 0)
+	{
+		const char* key = gensym(name)->s_name;
+		unsigned int n = slot(key);
+		if(!entries[n].name)
+		{
+			if(numEntries + 1 >= kSize)
+			{
+				fprintf(stderr, "Too many receivers: %s will be ignored\n", name);
+				return;
+			}
+			++numEntries;
+			libpd_bind(name);
+		}
+		entries[n] = HookEntry{key, uint16_t(receiver), uint16_t(arg)};
+	}
+	// returns an entry with receiver kHookNone if source was not bound here
+	const HookEntry& find(const char* source) const
+	{
+		return entries[slot(source)];
+	}
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	// binds the receivers of other in the current instance, which has its
+	// own symbols
+	void rebind(const HookTable& other)
+	{
+		*this = HookTable();
+		for(auto& e : other.entries)
+		{
+			if(e.name)
+				bind(e.name, HookReceiver(e.receiver), e.arg);
+		}
+	}
+#endif // BELA_LIBPD_SWAP_INSTANCES
+private:
+	enum { kBits = 8, kSize = 1 << kBits };
+	unsigned int slot(const char* key) const
+	{
+		unsigned int n = uint32_t(uintptr_t(key) * 2654435761u) >> (32 - kBits);
+		while(entries[n].name && entries[n].name != key)
+			n = (n + 1) & (kSize - 1);
+		return n;
+	}
+	HookEntry entries[kSize] = {};
+	unsigned int numEntries = 0;
+};
+static HookTable gHooks;
+#ifdef BELA_LIBPD_PIPELINE
+static void pipelineForward(const char* receiver, const char* selector, int argc, t_atom* argv);
+#endif // BELA_LIBPD_PIPELINE
+
+// The hooks of a patch that render() is not running yet, or not anymore,
+// must not touch the state render() and the other threads share with the
+// patch. While gPatchSwapTask opens a patch its hooks are queued, and
+// render() runs them once it has handed over to it (see patchSwapHandOff()).
+// The hooks of the outgoing patch are ignored while it is being closed or
+// crossfaded out.
+enum HookMode {
+	kHooksRun,
+	kHooksDefer,
+	kHooksIgnore,
+};
+static thread_local HookMode gHookMode = kHooksRun;
+struct DeferredHook
+{
+	enum Type {
+		kFloat,
+		kBang,
+		kSymbol,
+		kList,
+		kMessage,
+		kNoteOn,
+		kControlChange,
+		kProgramChange,
+		kPitchBend,
+		kAftertouch,
+		kPolyAftertouch,
+		kMidiByte,
+	} type;
+	// symbols of the new patch's instance, which outlive the queue
+	const char* source;
+	const char* symbol;
+	float value;
+	int midi[3];
+	std::vector<t_atom> argv;
+};
+static std::vector<DeferredHook> gDeferredHooks;
+
+// returns true if the hook is not to be run now
+static bool hookHeld(DeferredHook::Type type, const char* source, const char* symbol, float value, int argc = 0, t_atom* argv = nullptr)
+{
+	if(kHooksRun == gHookMode)
+		return false;
+	if(kHooksDefer == gHookMode)
+		gDeferredHooks.push_back(DeferredHook{type, source, symbol, value, {}, std::vector<t_atom>(argv, argv + argc)});
+	return true;
+}
+
+static bool midiHookHeld(DeferredHook::Type type, int a, int b = 0, int c = 0)
+{
+	if(kHooksRun == gHookMode)
+		return false;
+	if(kHooksDefer == gHookMode)
+		gDeferredHooks.push_back(DeferredHook{type, nullptr, nullptr, 0, {a, b, c}, {}});
+	return true;
+}
+
+// Subsystems that are only started if the patch references them, i.e.: if
+// after loading it has a receiver for something they send to it, or if it
+// sent them a message while loading (e.g.: [; bela_setTrill new ...( from a
+// [loadbang]). The scope is always started, as it is fed from [dac~].
+// A patch that only sends MIDI ([noteout] etc.) should open its ports with
+// bela_setMidi.
+enum {
+	kSubsystemGui = 1 << 0,
+	kSubsystemMidi = 1 << 1,
+	kSubsystemTrill = 1 << 2,
+};
+static const char* gSubsystemNames[] = {"GUI", "MIDI", "Trill"};
+static const struct {
+	const char* receiver;
+	unsigned int subsystem;
+} gSubsystemReceivers[] = {
+	{"bela_guiControl", kSubsystemGui},
+	{"bela_guiPoll", kSubsystemGui},
+	{"bela_midiBeat", kSubsystemMidi},
+	{"bela_midiRunning", kSubsystemMidi},
+	{"bela_midiTempo", kSubsystemMidi},
+	{"bela_midiLearned", kSubsystemMidi},
+	// what [notein], [ctlin] etc. bind to
+	{"#notein", kSubsystemMidi},
+	{"#ctlin", kSubsystemMidi},
+	{"#pgmin", kSubsystemMidi},
+	{"#bendin", kSubsystemMidi},
+	{"#touchin", kSubsystemMidi},
+	{"#polytouchin", kSubsystemMidi},
+	{"#midiin", kSubsystemMidi},
+	{"#sysexin", kSubsystemMidi},
+	{"#midirealtimein", kSubsystemMidi},
+	{"bela_trill", kSubsystemTrill},
+	{"bela_trillArray", kSubsystemTrill},
+	{"bela_trillCreated", kSubsystemTrill},
+};
+static unsigned int gSubsystemsReferenced = 0;
+static unsigned int gSubsystemsStarted = 0;
+static bool gPatchLoading = false;
+
+static unsigned int hookSubsystem(unsigned int receiver)
+{
+	switch(receiver)
+	{
+	case kHookSetMidi:
+	case kHookMidiClockSync:
+	case kHookMidiLearn:
+		return kSubsystemMidi;
+	case kHookGuiOut:
+	case kHookGuiTelemetry:
+	case kHookSetGui:
+		return kSubsystemGui;
+	case kHookSetTrill:
+		return kSubsystemTrill;
+	default:
+		return 0;
+	}
+}
+
+static bool subsystemStarted(unsigned int subsystem);
+
+// like gHooks.find(), but also records the subsystems the patch sends
+// messages to while it is loading. After that, messages to subsystems that
+// were not started are ignored.
+static const HookEntry& findHook(const char* source)
+{
+	static const HookEntry noHook = {nullptr, kHookNone, 0};
+	const HookEntry& hook = gHooks.find(source);
+	unsigned int subsystem = hookSubsystem(hook.receiver);
+	if(gPatchLoading)
+		gSubsystemsReferenced |= subsystem;
+	else if(subsystem && !subsystemStarted(subsystem))
+		return noHook;
+	return hook;
+}
+
+// for the receivers that need a subsystem to be running: warns the first
+// time one is used after loading without the subsystem having been started
+static bool subsystemStarted(unsigned int subsystem)
+{
+	if(gSubsystemsStarted & subsystem)
+		return true;
+	static unsigned int warned = 0;
+	if(!gPatchLoading && !(warned & subsystem))
+	{
+		warned |= subsystem;
+		for(unsigned int n = 0; n < sizeof(gSubsystemNames) / sizeof(gSubsystemNames[0]); ++n)
+		{
+			if(subsystem & (1 << n))
+				rt_fprintf(stderr, "%s was not started, as the patch did not reference it while loading\n", gSubsystemNames[n]);
+		}
+	}
+	return false;
+}
+
+static double loadTimeMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+#ifdef BELA_LIBPD_PROFILE_LOAD
+#include <dirent.h>
+// Opens each abstraction in folder on its own and prints how long it takes
+// to create it, including the abstractions it contains and its [loadbang]s.
+// This is called before any receiver is bound, so that messages sent while
+// loading (which Pd will complain about) have no effect.
+static void profilePatchLoad(const char* folder, const char* mainFile)
+{
+	DIR* dir = opendir(folder);
+	if(!dir)
+		return;
+	std::vector<std::string> files;
+	while(struct dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if(name.size() > 3 && 0 == name.compare(name.size() - 3, 3, ".pd") && name != mainFile)
+			files.push_back(name);
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+	printf("Load time of each abstraction:\n");
+	for(auto& name : files)
+	{
+		double start = loadTimeMs();
+		void* patch = libpd_openfile(name.c_str(), folder);
+		double elapsed = loadTimeMs() - start;
+		if(!patch)
+			continue;
+		libpd_closefile(patch);
+		printf("%24s %8.2f ms\n", name.c_str(), elapsed);
+	}
+}
+#endif // BELA_LIBPD_PROFILE_LOAD
+
 #if (defined(BELA_LIBPD_GUI) || defined(BELA_LIBPD_TRILL))
 #include <libraries/Pipe/Pipe.h>
 template <typename T>
@@ -99,89 +498,373 @@ Encoder::Polarity polarity = Encoder::ANY; // could be ANY, ACTIVE_LOW, ACTIVE_H
 
 #ifdef BELA_LIBPD_TRILL
 #include <tuple>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include <stddef.h>
 #include <libraries/Trill/Trill.h>
 AuxiliaryTask gTrillTask;
 Pipe gTrillPipe;
 
-static std::vector<std::string> gTrillAcks;
-static std::vector<std::pair<std::string,Trill*>> gTouchSensors;
-// how often to read the cap sensors inputs.
-float touchSensorSleepInterval = 0.007;
+// what a patch creates with bela_setTrill
+struct TrillState
+{
+	std::vector<std::pair<std::string,Trill*>> sensors;
+	std::vector<std::string> arrayNames; // "bela_trill_<sensor_id>"
+	// sizes of the arrays above (-1 if missing), so that the audio thread
+	// does not look them up for every frame. Looked up when the creation of
+	// the sensor is acknowledged.
+	std::vector<int> arraySizes;
+	std::vector<std::string> acks;
+	// the first sensors, for readTouchSensors(). Only changed with
+	// gTrillLock held, see trillCommit()
+	std::vector<Trill*> polled;
+};
+// the running patch's, used by render()
+static TrillState gTrill;
+// the next patch's, set up by gPatchSwapTask before the handoff, then the
+// previous patch's until gPatchSwapTask releases them
+static TrillState gTrillNext;
+
+// adds the sensors created since the last call to state.polled
+static void trillAddPolled(TrillState& state)
+{
+	for(unsigned int n = state.polled.size(); n < state.sensors.size(); ++n)
+		state.polled.push_back(state.sensors[n].second);
+}
+
+// called by render(): hands the sensors created since the last call over to
+// readTouchSensors(), once it is not using them
+static void trillCommit()
+{
+	if(gTrill.polled.size() == gTrill.sensors.size() || !gTrillLock.tryLock())
+		return;
+	trillAddPolled(gTrill);
+	gTrillLock.unlock();
+}
+// how often to read the cap sensors inputs: fast while any of them is
+// touched, slowing down once they have all been idle for a while
+float touchSensorActiveInterval = 0.005;
+float touchSensorIdleInterval = 0.05;
+float touchSensorIdleTimeout = 0.5;
+std::atomic<float> touchSensorSleepInterval(touchSensorIdleInterval);
+// raw readings that moved by less than this since the last frame sent are
+// not sent again
+float touchSensorRawThreshold = 0.002;
+
+// readTouchSensors() only sends a frame when its content changed. Raw
+// frames go to the array bela_trill_<sensor_id> if the patch has one, and
+// to [s bela_trill] otherwise
+enum { kTrillMaxValues = 64 };
+struct TrillFrame
+{
+	uint32_t sensor;
+	uint32_t raw;
+	uint32_t count;
+	float values[kTrillMaxValues];
+};
+
+// returns true if the sensor is being touched
+static bool getTrillFrame(Trill& touchSensor, TrillFrame& frame)
+{
+	const Trill::Mode mode = touchSensor.getMode();
+	frame.raw = (Trill::DIFF == mode || Trill::RAW == mode || Trill::BASELINE == mode);
+	frame.count = 0;
+	if(frame.raw)
+	{
+		frame.count = std::min(touchSensor.getNumChannels(), (unsigned int)kTrillMaxValues);
+		for(unsigned int n = 0; n < frame.count; ++n)
+			frame.values[n] = touchSensor.rawData[n];
+		return false; // decided by the caller, from how much it changed
+	}
+	if(Trill::CENTROID != mode)
+		return false;
+	if(touchSensor.is1D()) {
+		unsigned int numTouches = std::min(touchSensor.getNumTouches(), (unsigned int)(kTrillMaxValues - 1) / 2);
+		frame.values[frame.count++] = numTouches;
+		for(unsigned int i = 0; i < numTouches; i++) {
+			frame.values[frame.count++] = touchSensor.touchLocation(i);
+			frame.values[frame.count++] = touchSensor.touchSize(i);
+		}
+		return numTouches > 0;
+	} else if (touchSensor.is2D()) {
+		int numTouches = touchSensor.compoundTouchSize() > 0;
+		frame.values[frame.count++] = numTouches > 0;
+		if(numTouches)
+		{
+			frame.values[frame.count++] = touchSensor.compoundTouchHorizontalLocation();
+			frame.values[frame.count++] = touchSensor.compoundTouchLocation();
+			frame.values[frame.count++] = touchSensor.compoundTouchSize();
+		}
+		return numTouches > 0;
+	}
+	return false;
+}
 
 void readTouchSensors(void*)
 {
-	for(unsigned int n = 0; n < gTouchSensors.size(); ++n)
+	static std::vector<std::vector<float>> lastFrames;
+	static float idleTime = 0;
+	if(!gTrillLock.enter())
+		return; // render() is adding sensors or handing over to another patch
+	lastFrames.resize(gTrill.polled.size());
+	bool active = false;
+	for(unsigned int n = 0; n < gTrill.polled.size(); ++n)
 	{
-		Trill& touchSensor = *gTouchSensors[n].second;
+		Trill& touchSensor = *gTrill.polled[n];
 		int ret;
 		const Trill::Device type = touchSensor.deviceType();
 		if(Trill::NONE == type)
 			ret = 1;
 		else
 			ret = touchSensor.readI2C();
-		if(!ret)
-		{
-			gTrillPipe.writeNonRt(n);
-		}
+		if(ret)
+			continue;
+		TrillFrame frame;
+		frame.sensor = n;
+		bool touched = getTrillFrame(touchSensor, frame);
+		std::vector<float>& last = lastFrames[n];
+		bool changed = last.size() != frame.count;
+		float threshold = frame.raw ? touchSensorRawThreshold : 0;
+		for(unsigned int c = 0; c < frame.count && !changed; ++c)
+			changed = fabsf(frame.values[c] - last[c]) > threshold;
+		if(touched || (frame.raw && changed))
+			active = true;
+		if(!changed)
+			continue;
+		last.assign(frame.values, frame.values + frame.count);
+		gTrillPipe.writeNonRt((const char*)&frame, offsetof(TrillFrame, values) + frame.count * sizeof(frame.values[0]));
 	}
+	gTrillLock.leave();
+	idleTime = active ? 0 : idleTime + touchSensorSleepInterval;
+	touchSensorSleepInterval = idleTime < touchSensorIdleTimeout ? touchSensorActiveInterval : touchSensorIdleInterval;
 }
 #endif // BELA_LIBPD_TRILL
 
 #ifdef BELA_LIBPD_GUI
 #include <libraries/Gui/Gui.h>
+#include <algorithm>
+#include <atomic>
 
 Pipe gGuiPipe;
 Gui gui;
+
+// Content of a Gui data buffer, handed over from the Gui thread to the audio
+// thread through three slots: the Gui thread fills its back slot and swaps it
+// with the middle one, render() swaps its front slot with the middle one only
+// when a newer frame has been published. Neither side ever waits, allocates
+// or sees a half-written frame, and the array is only written to Pd when
+// the Gui has actually sent new content.
+class GuiArrayBuffer
+{
+public:
+	GuiArrayBuffer(unsigned int size) : middle(1)
+	{
+		for(auto& slot : slots)
+			slot.resize(size);
+	}
+
+	// called from the Gui thread
+	void write(const char* data, unsigned int size)
+	{
+		unsigned int count = std::min(size / (unsigned int)sizeof(float), (unsigned int)slots[back].size());
+		memcpy(slots[back].data(), data, count * sizeof(float));
+		counts[back] = count;
+		back = middle.exchange(back | kFresh) & ~kFresh;
+	}
+
+	// called from the audio thread. Returns nullptr if nothing new has
+	// been written since the last call
+	const float* read(unsigned int& count)
+	{
+		if(!(middle.load() & kFresh))
+			return nullptr;
+		front = middle.exchange(front) & ~kFresh;
+		count = counts[front];
+		return slots[front].data();
+	}
+
+private:
+	enum { kFresh = 4 };
+	std::vector<float> slots[3];
+	unsigned int counts[3] = {};
+	std::atomic<unsigned int> middle; // index of the middle slot, | kFresh if it hasn't been read yet
+	unsigned int back = 0;
+	unsigned int front = 2;
+};
+
 struct bufferDescription
 {
 	std::string name;
 	int id;
 	int size;
+	GuiArrayBuffer* array;
+};
+// indexed by Gui buffer id, for the Gui thread, which only uses the
+// GuiArrayBuffers with gGuiControlsLock held
+enum { kGuiMaxArrays = 32 };
+static std::atomic<GuiArrayBuffer*> gGuiArrays[kGuiMaxArrays];
+// what a patch creates with bela_setGui
+struct GuiState
+{
+	std::vector<struct bufferDescription> dataBuffers;
+	std::vector<std::string> controlBuffers;
+	// precomputed for the first controls, so that incoming messages can be
+	// matched without converting strings. Used by the Gui thread and only
+	// changed with gGuiControlsLock held, see guiControlsCommit()
+	std::vector<std::wstring> controlKeys;
+	std::vector<uint32_t> controlIds;
 };
-static std::vector<struct bufferDescription> gGuiDataBuffers;
-static std::vector<std::string> gGuiControlBuffers;
+// the running patch's, used by render()
+static GuiState gGui;
+// the next patch's, set up by gPatchSwapTask before the handoff, then the
+// previous patch's until gPatchSwapTask releases them
+static GuiState gGuiNext;
+// Each pipe datagram is a header followed by size bytes of payload:
+// 'f': one float for control id
+// 's': a null-terminated string for control id
+// 'F': id pairs of (control id, float value), from a binary control frame
 struct guiControlMessageHeader
 {
 	uint32_t size;
 	uint32_t type;
 	uint32_t id;
 };
+struct guiControlValue
+{
+	uint32_t id;
+	float value;
+};
+enum { kGuiMaxControlMessage = 4096 }; // must fit in a kRtScratchGui slot
+
+// GUI-visible state (encoder values, fx page, expression slot) is sampled
+// from gui.pd by sending a bang to bela_guiPoll, which makes it reply with
+// a list on bela_guiTelemetry: the buffer number followed by the values.
+// This is done at gGuiTelemetryRate and the buffer is sent to the browser
+// only when the values have changed (or a new client has connected). The
+// browser can ask for a lower rate with the telemetryRate control.
+enum { kGuiTelemetryMaxValues = 16 };
+struct GuiTelemetry
+{
+	int bufNum;
+	unsigned int numValues;
+	float values[kGuiTelemetryMaxValues];
+};
+static GuiTelemetry gGuiTelemetrySent = {-1, 0, {}};
+static int gGuiTelemetryConnections = 0;
+static unsigned int gGuiTelemetrySamples = 0;
+const float gGuiTelemetryMaxRate = 30;
+const float gGuiTelemetryMinRate = 1;
+static std::atomic<float> gGuiTelemetryRate(gGuiTelemetryMaxRate);
+
+// called from the Gui thread
+static void guiTelemetrySetRate(float rate)
+{
+	gGuiTelemetryRate = std::min(gGuiTelemetryMaxRate, std::max(gGuiTelemetryMinRate, rate));
+}
+
+static void guiTelemetryReceive(int argc, t_atom *argv)
+{
+	GuiTelemetry t;
+	if(argc < 1 || !libpd_is_float(argv))
+		return;
+	t.bufNum = libpd_get_float(argv);
+	t.numValues = std::min(argc - 1, int(kGuiTelemetryMaxValues));
+	for(unsigned int n = 0; n < t.numValues; ++n)
+		t.values[n] = libpd_is_float(argv + 1 + n) ? libpd_get_float(argv + 1 + n) : 0;
+	int connections = gui.numConnections();
+	if(!connections)
+		return;
+	if(connections == gGuiTelemetryConnections
+		&& t.bufNum == gGuiTelemetrySent.bufNum
+		&& t.numValues == gGuiTelemetrySent.numValues
+		&& 0 == memcmp(t.values, gGuiTelemetrySent.values, t.numValues * sizeof(t.values[0])))
+		return;
+	gui.sendBuffer(t.bufNum, t.values, t.numValues);
+	gGuiTelemetrySent = t;
+	gGuiTelemetryConnections = connections;
+}
+
+// Binary control frames sent by sketch.js start with this, followed by
+// (id, value) pairs, where id is guiControlId() of the control's name
+static const uint32_t kGuiControlFrameMagic = 0x31465342; // "BSF1"
+
+// 32-bit FNV-1a, also computed in sketch.js
+static uint32_t guiControlId(const char* name)
+{
+	uint32_t hash = 2166136261u;
+	for(; *name; ++name)
+	{
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// computes the keys and ids of the controls added to state since the last call
+static void guiControlsAddKeys(GuiState& state)
+{
+	for(unsigned int n = state.controlKeys.size(); n < state.controlBuffers.size(); ++n)
+	{
+		state.controlKeys.emplace_back(JSON::s2ws(state.controlBuffers[n]));
+		state.controlIds.emplace_back(guiControlId(state.controlBuffers[n].c_str()));
+	}
+}
+
+// called by render(): hands the controls created since the last call over
+// to the Gui thread, once it is not using them
+static void guiControlsCommit()
+{
+	if(gGui.controlKeys.size() == gGui.controlBuffers.size() || !gGuiControlsLock.tryLock())
+		return;
+	guiControlsAddKeys(gGui);
+	gGuiControlsLock.unlock();
+}
+
+static void guiControlSend(uint32_t type, uint32_t id, const void* data, uint32_t size)
+{
+	char message[kGuiMaxControlMessage];
+	struct guiControlMessageHeader header;
+	header.type = type;
+	header.id = id;
+	header.size = std::min(size, uint32_t(sizeof(message) - sizeof(header)));
+	memcpy(message, &header, sizeof(header));
+	memcpy(message + sizeof(header), data, header.size);
+	if('s' == type && header.size)
+		message[sizeof(header) + header.size - 1] = '\0'; // in case it was truncated
+	// header and payload go in the same datagram, so that render() only
+	// ever receives complete messages
+	gGuiPipe.writeNonRt(message, sizeof(header) + header.size);
+}
 
 bool guiControlDataCallback(JSONObject& root, void* arg)
 {
 	int ret = true;
-	for(unsigned int n = 0; n < gGuiControlBuffers.size(); ++n)
+	auto rate = root.find(L"telemetryRate");
+	if(root.end() != rate && rate->second->IsNumber())
+	{
+		guiTelemetrySetRate(rate->second->AsNumber());
+		ret = false;
+	}
+	if(!gGuiControlsLock.enter())
+		return ret; // render() is adding controls or handing over to another patch
+	for(unsigned int n = 0; n < gGui.controlKeys.size(); ++n)
 	{
-		const auto& b = gGuiControlBuffers[n];
-		std::wstring key = JSON::s2ws(b);
-		if (root.end() != root.find(key))
+		auto it = root.find(gGui.controlKeys[n]);
+		if (root.end() != it)
 		{
-			JSONValue* found = root[key];
-			struct guiControlMessageHeader header;
-			header.id = n;
-			char* array;
+			JSONValue* found = it->second;
 			if(found->IsString())
 			{
 				std::string value = JSON::ws2s(found->AsString());
-				header.type = 's';
-				header.size = value.size();
-				array = (char*)alloca(header.size);
-				memcpy(array, value.c_str(), header.size);
+				guiControlSend('s', n, value.c_str(), value.size() + 1);
 			} else if(found->IsNumber())
 			{
 				float value = found->AsNumber();
-				header.type = 'f';
-				header.size = sizeof(value);
-				array = (char*)alloca(header.size);
-				memcpy(array, &value, header.size);
+				guiControlSend('f', n, &value, sizeof(value));
 			} else {
 				continue;
 			}
-			// do two separate reads: the pipe is datagram-based
-			// so it would be impossible to receive partial messages
-			// at the other end
-			gGuiPipe.writeNonRt(header);
-			gGuiPipe.writeNonRt(&array[0], header.size);
 			// we have successully parsed this message, so the
 			// default parser shouldn't when we return
 			// note: in practice there may be times when we'd want
@@ -192,16 +875,187 @@ bool guiControlDataCallback(JSONObject& root, void* arg)
 			continue;
 		}
 	}
+	gGuiControlsLock.leave();
 	return ret;
 }
 
+// decode a binary control frame and forward all of its values in one datagram
+static void guiControlFrame(const char* data, unsigned int size)
+{
+	guiControlValue values[(kGuiMaxControlMessage - sizeof(guiControlMessageHeader)) / sizeof(guiControlValue)];
+	unsigned int numValues = 0;
+	static const uint32_t telemetryRateId = guiControlId("telemetryRate");
+	if(!gGuiControlsLock.enter())
+		return;
+	for(unsigned int offset = sizeof(kGuiControlFrameMagic); offset + sizeof(guiControlValue) <= size && numValues < sizeof(values) / sizeof(values[0]); offset += sizeof(guiControlValue))
+	{
+		guiControlValue v;
+		memcpy(&v, data + offset, sizeof(v));
+		if(telemetryRateId == v.id)
+		{
+			guiTelemetrySetRate(v.value);
+			continue;
+		}
+		for(unsigned int n = 0; n < gGui.controlIds.size(); ++n)
+		{
+			if(gGui.controlIds[n] == v.id)
+			{
+				values[numValues].id = n;
+				values[numValues].value = v.value;
+				++numValues;
+				break;
+			}
+		}
+	}
+	gGuiControlsLock.leave();
+	if(numValues)
+		guiControlSend('F', numValues, values, numValues * sizeof(values[0]));
+}
+
+// Binary data from the Gui uses the same framing as the default handler: a
+// message with the buffer id, followed by one with the buffer content.
+// Arrays created with [bela_setGui new array <name>( go to their
+// GuiArrayBuffer instead of the Gui's own DataBuffer. Control frames are
+// recognised by their size and magic number.
+bool guiBinaryDataCallback(const char* data, unsigned int size, void* arg)
+{
+	static int receiving = -1;
+	if(receiving >= 0)
+	{
+		// the buffer may have been released by a patch swap in the meantime
+		if(gGuiControlsLock.enter())
+		{
+			GuiArrayBuffer* array = gGuiArrays[receiving];
+			if(array)
+				array->write(data, size);
+			gGuiControlsLock.leave();
+		}
+		receiving = -1;
+		return false;
+	}
+	if(size > sizeof(kGuiControlFrameMagic) && 0 == (size - sizeof(kGuiControlFrameMagic)) % sizeof(guiControlValue)
+		&& 0 == memcmp(data, &kGuiControlFrameMagic, sizeof(kGuiControlFrameMagic)))
+	{
+		guiControlFrame(data, size);
+		return false;
+	}
+	uint32_t id;
+	if(size != sizeof(id))
+		return true;
+	memcpy(&id, data, sizeof(id));
+	if(id >= kGuiMaxArrays || !gGuiArrays[id].load())
+		return true;
+	receiving = id;
+	return false;
+}
+
+// call once the array exists in the patch
+static bool setupGuiDataBuffer(bufferDescription& b)
+{
+	int size = libpd_arraysize(b.name.c_str());
+	if(size <= 0)
+		return false;
+	b.id = gui.setBuffer('f', size);
+	b.size = size;
+	DataBuffer& dataBuffer = gui.getDataBuffer(b.id);
+	// initialize gui buffer with the initial content of the array
+	libpd_read_array(dataBuffer.getAsFloat(), b.name.c_str(), 0, size);
+	b.array = new GuiArrayBuffer(size);
+	if(b.id < kGuiMaxArrays)
+		gGuiArrays[b.id] = b.array;
+	else
+		fprintf(stderr, "Gui buffer %d for %s will not be received: too many buffers\n", b.id, b.name.c_str());
+	return true;
+}
+
+// Gui buffers cannot be removed from the Gui, so a new patch takes over the
+// buffers of the same size that are not used anymore: first those of the
+// running patch, with their GuiArrayBuffer, then those released by earlier
+// swaps. The running patch's are listed by patchSwapRequest(), as render()
+// may add to gGui.dataBuffers at any time.
+struct GuiSpareBuffer
+{
+	int id;
+	int size;
+	GuiArrayBuffer* array; // nullptr once it has been taken or freed
+};
+static GuiSpareBuffer gGuiRunningBuffers[kGuiMaxArrays];
+static unsigned int gGuiNumRunningBuffers = 0;
+static std::vector<GuiSpareBuffer> gGuiFreeBuffers; // used by gPatchSwapTask only
+
+// called from render() when a swap is requested
+static void guiListRunningBuffers()
+{
+	gGuiNumRunningBuffers = 0;
+	for(auto& b : gGui.dataBuffers)
+	{
+		if(b.array && b.id < kGuiMaxArrays)
+			gGuiRunningBuffers[gGuiNumRunningBuffers++] = GuiSpareBuffer{b.id, b.size, b.array};
+	}
+}
+
+// like setupGuiDataBuffer(), for the next patch: called from gPatchSwapTask.
+// render() publishes the buffer in gGuiArrays at the handoff
+static bool guiTakeOverBuffer(bufferDescription& b)
+{
+	int size = libpd_arraysize(b.name.c_str());
+	if(size <= 0)
+		return false;
+	GuiArrayBuffer* array = nullptr;
+	b.id = -1;
+	for(unsigned int n = 0; n < gGuiNumRunningBuffers && b.id < 0; ++n)
+	{
+		GuiSpareBuffer& spare = gGuiRunningBuffers[n];
+		if(spare.array && spare.size == size)
+		{
+			b.id = spare.id;
+			array = spare.array;
+			spare.array = nullptr;
+		}
+	}
+	for(unsigned int n = 0; n < gGuiFreeBuffers.size() && b.id < 0; ++n)
+	{
+		if(gGuiFreeBuffers[n].size == size)
+		{
+			b.id = gGuiFreeBuffers[n].id;
+			array = new GuiArrayBuffer(size);
+			gGuiFreeBuffers.erase(gGuiFreeBuffers.begin() + n);
+		}
+	}
+	if(b.id < 0)
+		return setupGuiDataBuffer(b);
+	b.size = size;
+	b.array = array;
+	libpd_read_array(gui.getDataBuffer(b.id).getAsFloat(), b.name.c_str(), 0, size);
+	return true;
+}
+
+// called from gPatchSwapTask once render() has handed over: frees the
+// GuiArrayBuffers of the previous patch that the new one has not taken over
+// and keeps their Gui buffers for the next swaps
+static void guiReleaseBuffers(GuiState& previous)
+{
+	for(auto& b : previous.dataBuffers)
+	{
+		if(b.id < 0)
+			continue;
+		if(b.id < kGuiMaxArrays && gGuiArrays[b.id] == b.array)
+			continue; // taken over
+		delete b.array;
+		gGuiFreeBuffers.push_back(GuiSpareBuffer{b.id, b.size, nullptr});
+	}
+}
+
 #endif // BELA_LIBPD_GUI
 #ifdef BELA_LIBPD_SERIAL
 #include <libraries/Serial/Serial.h>
 #include <libraries/Pipe/Pipe.h>
 #include <string>
+#include <atomic>
+#include <algorithm>
 
 Pipe gSerialPipe;
+Pipe gSerialOutPipe;
 Serial gSerial;
 std::string gSerialId;
 int gSerialEom;
@@ -213,84 +1067,694 @@ enum SerialType {
 AuxiliaryTask gSerialInputTask;
 AuxiliaryTask gSerialOutputTask;
 
+// Serial input is read into a ring buffer. Whenever a message is complete
+// (its EOM has been received, or as soon as anything is read when there is
+// no EOM) it is split into tokens here and sent to render() as one
+// datagram: a serialMessageHeader, the null-terminated data (padded to 4
+// bytes) with each separator replaced by '\0', then the offset of each token
+// within the data. The audio thread then only has to convert the tokens.
 struct serialMessageHeader
 {
-	uint32_t idSize;
-	uint32_t dataSize;
+	uint32_t dataSize; // including the terminating null
+	uint32_t numTokens;
+};
+enum {
+	kSerialRingSize = 16384,
+	kSerialMaxMessage = 2048, // longer messages are split
 };
 
-void serialOutputLoop(void* arg) {
-	// TODO: implement
+static uint32_t serialPadded(uint32_t size)
+{
+	return (size + 3) & ~3;
 }
 
-void serialInputLoop(void* arg) {
-	char serialBuffer[10000];
-	unsigned int i = 0;
-	serialMessageHeader h = {
-		.idSize = strlen(gSerialId.c_str()) + 1,
-	};
-	while(!Bela_stopRequested())
+// returns the position, relative to start, of the last space in the size
+// bytes from start, or 0 if there is none
+static uint32_t serialLastSeparator(const char* ring, uint32_t start, uint32_t size)
+{
+	for(uint32_t n = size; n > 0; --n)
 	{
-		// read from the serial port with a timeout of 100ms
-		int ret = gSerial.read(serialBuffer + i, sizeof(serialBuffer) - i, 100);
-		if (ret > 0) {
-			if(gSerialEom < 0)
+		if(' ' == ring[(start + n - 1) % kSerialRingSize])
+			return n - 1;
+	}
+	return 0;
+}
+
+static void serialSendMessage(const char* ring, uint32_t start, uint32_t size)
+{
+	static char message[sizeof(serialMessageHeader) + kSerialMaxMessage + sizeof(uint32_t) * (kSerialMaxMessage / 2 + 1)];
+	while(size)
+	{
+		serialMessageHeader h;
+		uint32_t chunk = std::min(size, uint32_t(kSerialMaxMessage - 1));
+		uint32_t skip = 0;
+		if(chunk < size)
+		{
+			// split at the last separator, so that no token is cut in half
+			uint32_t separator = serialLastSeparator(ring, start, chunk);
+			if(separator)
 			{
-				h.dataSize = ret;
-				// send everything immediately
-				gSerialPipe.writeNonRt(h);
-				gSerialPipe.writeNonRt(gSerialId.c_str(), h.idSize);
-				gSerialPipe.writeNonRt(serialBuffer, h.dataSize);
-			} else {
-				// find EOM in new data
-				unsigned int searchStart = i;
-				unsigned int searchStop = searchStart + ret;
-				unsigned int n;
-				unsigned int lastSent = 0;
-				bool found;
-				do
+				chunk = separator;
+				skip = 1;
+			}
+		}
+		char* data = message + sizeof(h);
+		uint32_t pos = start % kSerialRingSize;
+		uint32_t first = std::min(chunk, kSerialRingSize - pos);
+		memcpy(data, ring + pos, first);
+		memcpy(data + first, ring, chunk - first);
+		data[chunk] = '\0';
+		h.dataSize = chunk + 1;
+		h.numTokens = 0;
+		uint32_t* offsets = (uint32_t*)(data + serialPadded(h.dataSize));
+		if(kSerialSymbol != gSerialType)
+		{
+			bool inToken = false;
+			for(uint32_t n = 0; n < chunk; ++n)
+			{
+				if(' ' == data[n] || '\0' == data[n])
 				{
-					found = false;
-					for(n = searchStart; n < searchStop; ++n)
-					{
-						if(serialBuffer[n] == gSerialEom)
-						{
-							found = true;
-							break;
-						}
-					}
-					// if found, send all data till that point
-					if(found)
-					{
-						h.dataSize = n - lastSent;
-						if(h.dataSize)
-						{
-							gSerialPipe.writeNonRt(h);
-							gSerialPipe.writeNonRt(gSerialId.c_str(), h.idSize);
-							gSerialPipe.writeNonRt(serialBuffer + lastSent, h.dataSize);
-						}
-						searchStart = n + 1;
-						lastSent += 1 + h.dataSize;
-					}
+					data[n] = '\0';
+					inToken = false;
+				} else if(!inToken) {
+					offsets[h.numTokens++] = n;
+					inToken = true;
 				}
-				while(found);
-				// if we are left with any data, move it to the beginning of the buffer.
-				// TODO: avoid this and use it as a circular buffer
-				if(searchStart != i)
-					memmove(serialBuffer, serialBuffer + searchStart, searchStop - searchStart);
-				i = searchStop - searchStart;
 			}
 		}
+		memcpy(message, &h, sizeof(h));
+		gSerialPipe.writeNonRt(message, sizeof(h) + serialPadded(h.dataSize) + h.numTokens * sizeof(offsets[0]));
+		start += chunk + skip;
+		size -= chunk + skip;
 	}
 }
 
-#endif // BELA_LIBPD_SERIAL
+// like atof() for plain decimal numbers ([+-]digits[.digits][(e|E)[+-]digits]),
+// but without the locale handling
+static float serialParseFloat(const char* s)
+{
+	bool negative = false;
+	if('-' == *s || '+' == *s)
+		negative = '-' == *s++;
+	double value = 0;
+	for(; *s >= '0' && *s <= '9'; ++s)
+		value = value * 10 + (*s - '0');
+	if('.' == *s)
+	{
+		double scale = 0.1;
+		for(++s; *s >= '0' && *s <= '9'; ++s, scale *= 0.1)
+			value += (*s - '0') * scale;
+	}
+	if('e' == *s || 'E' == *s)
+	{
+		++s;
+		bool negativeExp = false;
+		if('-' == *s || '+' == *s)
+			negativeExp = '-' == *s++;
+		int exp = 0;
+		for(; *s >= '0' && *s <= '9' && exp < 100; ++s)
+			exp = exp * 10 + (*s - '0');
+		for(; exp > 0; --exp)
+			value = negativeExp ? value * 0.1 : value * 10;
+	}
+	return negative ? -value : value;
+}
 
-enum { minFirstDigitalChannel = 10 };
-static unsigned int gAnalogChannelsInUse;
-static unsigned int gDigitalChannelsInUse;
+// Anything sent to [s bela_serialOut] is queued by the audio thread as one
+// datagram on gSerialOutPipe: floats become one byte each (0 to 255) and
+// symbols are sent as their characters. serialOutputLoop() waits for the
+// first message and then appends everything else that is queued, so that
+// it makes as few writes as possible. When more than kSerialOutHighWater
+// bytes are waiting, or messages had to be dropped because the queue was
+// full, render() sends [busy pendingBytes droppedMessages( to
+// bela_serialOutStatus.
+enum {
+	kSerialOutMaxWrite = 16384,
+	kSerialOutHighWater = 16384,
+};
+std::atomic<uint32_t> gSerialOutWritten(0); // bytes taken off the queue by serialOutputLoop()
+uint32_t gSerialOutQueued = 0; // bytes queued by the audio thread
+uint32_t gSerialOutDropped = 0; // messages dropped by the audio thread
+uint32_t gSerialOutDroppedReported = 0;
+bool gSerialOutBusy = false;
+
+static bool serialOutAppend(char* buffer, size_t& size, const char* data, size_t length)
+{
+	if(size + length > RtScratch::capacity<char>())
+		return false;
+	memcpy(buffer + size, data, length);
+	size += length;
+	return true;
+}
+
+// call from the audio thread. selector can be nullptr
+static void serialOutEnqueue(const char* selector, int argc, t_atom* argv)
+{
+	if(!gSerialOutputTask)
+		return;
+	char* buffer = gRtScratch.get<char>(kRtScratchSerialOut, RtScratch::capacity<char>());
+	size_t size = 0;
+	bool ok = true;
+	if(selector)
+		ok = serialOutAppend(buffer, size, selector, strlen(selector));
+	for(int n = 0; n < argc && ok; ++n)
+	{
+		if(libpd_is_float(argv + n))
+		{
+			unsigned char byte = std::min(255.f, std::max(0.f, libpd_get_float(argv + n)));
+			ok = serialOutAppend(buffer, size, (const char*)&byte, 1);
+		} else if(libpd_is_symbol(argv + n)) {
+			const char* symbol = libpd_get_symbol(argv + n);
+			ok = serialOutAppend(buffer, size, symbol, strlen(symbol));
+		}
+	}
+	if(!ok)
+	{
+		rt_fprintf(stderr, "bela_serialOut: message too long\n");
+		return;
+	}
+	if(!size)
+		return;
+	if(gSerialOutPipe.writeRt(buffer, size))
+		gSerialOutQueued += size;
+	else
+		++gSerialOutDropped;
+}
+
+void serialOutputLoop(void* arg) {
+	static char buffer[kSerialOutMaxWrite];
+	static char message[RtScratch::kSlotSize];
+	gSerialOutPipe.setTimeoutMsNonRt(100);
+	while(!Bela_stopRequested())
+	{
+		gSerialOutPipe.setBlockingNonRt(true);
+		int ret = gSerialOutPipe.readNonRt(message, sizeof(message));
+		if(ret <= 0)
+			continue;
+		memcpy(buffer, message, ret);
+		size_t size = ret;
+		// coalesce whatever else is already queued
+		gSerialOutPipe.setBlockingNonRt(false);
+		while(1)
+		{
+			ret = gSerialOutPipe.readNonRt(message, sizeof(message));
+			if(ret <= 0)
+				break;
+			if(size + ret > sizeof(buffer))
+			{
+				gSerial.write(buffer, size);
+				gSerialOutWritten += size;
+				size = 0;
+			}
+			memcpy(buffer + size, message, ret);
+			size += ret;
+		}
+		gSerial.write(buffer, size);
+		gSerialOutWritten += size;
+	}
+}
+
+void serialInputLoop(void* arg) {
+	static char ring[kSerialRingSize];
+	uint32_t written = 0; // total number of bytes read into the ring
+	uint32_t sent = 0; // total number of bytes sent to render()
+	while(!Bela_stopRequested())
+	{
+		// read into the free space after the last byte written, up to
+		// the end of the ring
+		uint32_t pos = written % kSerialRingSize;
+		uint32_t space = std::min(kSerialRingSize - (written - sent), kSerialRingSize - pos);
+		// read from the serial port with a timeout of 100ms
+		int ret = gSerial.read(ring + pos, space, 100);
+		if(ret <= 0)
+			continue;
+		written += ret;
+		if(gSerialEom < 0)
+		{
+			// send everything immediately
+			serialSendMessage(ring, sent, written - sent);
+			sent = written;
+			continue;
+		}
+		// the new data is contiguous: look for EOMs in it
+		const char* end = ring + pos + ret;
+		const char* eom;
+		for(const char* p = ring + pos; p < end && (eom = (const char*)memchr(p, gSerialEom, end - p)); p = eom + 1)
+		{
+			uint32_t eomPos = written - (end - eom);
+			if(eomPos != sent)
+				serialSendMessage(ring, sent, eomPos - sent);
+			sent = eomPos + 1;
+		}
+		// no EOM in sight: don't let the ring fill up, but keep the last
+		// token, which may not be complete yet
+		if(written - sent >= kSerialMaxMessage)
+		{
+			uint32_t separator = serialLastSeparator(ring, sent, written - sent);
+			if(separator)
+			{
+				serialSendMessage(ring, sent, separator);
+				sent += separator + 1;
+			} else {
+				serialSendMessage(ring, sent, written - sent);
+				sent = written;
+			}
+		}
+	}
+}
+
+#endif // BELA_LIBPD_SERIAL
+#ifdef BELA_LIBPD_OLED
+#include <libraries/OscSender/OscSender.h>
+#include <math.h>
+#include <time.h>
+
+// Display state for the OLED program (see Projects/OLED/main.cpp).
+// We listen to the same receivers that drive the effects, keep the canonical
+// value of each parameter here and send the active page to the screen only
+// when one of its visible digits changes. This replaces the [change],
+// [spigot] and [latency_fix] network that used to live in oled.pd.
+OscSender gOledSender;
+const int gOledRemotePort = 7562;
+const char* gOledRemoteIp = "127.0.0.1";
+// do not publish anything while the patch is initialising
+const float gOledStartupHoldMs = 3000;
+// minimum time between two messages to the screen
+const float gOledMinIntervalMs = 30;
+// how far past the rounding boundary (in displayed units) a value has to
+// move before the digit on screen changes
+const float gOledHysteresis = 0.25;
+// live data for the level meters, the looper position bar and the
+// scrolling waveform is decimated here and sent in one /stream message
+// per frame
+const float gOledStreamFps = 20;
+// time span of the scrolling waveform
+const float gOledWaveformSeconds = 4;
+enum {
+	kOledWaveformColumns = 128, // one min/max pair per pixel column
+	kOledMaxColumnsPerFrame = 64, // at most 128 bytes of waveform per frame
+};
+
+enum { kOledMaxSlots = 4 };
+struct OledPage
+{
+	const char* selector; // the page becomes active when this receives 1
+	const char* address;
+	unsigned int numSlots;
+	const char* params[kOledMaxSlots];
+	// the value received is multiplied by this and displayed as an integer:
+	// 100 for the normalised parameters, 1 for those already in ms or Hz
+	float scales[kOledMaxSlots];
+	const char* expSelectors[kOledMaxSlots];
+	const char* expAddresses[kOledMaxSlots];
+};
+
+static const OledPage gOledPages[] = {
+	{"fx1", "/scanner_vibrato", 4,
+		{"d/w_scn", "scanner", "rate", "depth"},
+		{100, 100, 100, 100},
+		{"exp_sel1/1", "exp_sel2/1", "exp_sel3/1", "exp_sel4/1"},
+		{"/d/w_scn_exp", "/scanner_exp", "/rate_exp", "/depth_exp"}},
+	{"fx2.1", "/tape_delay_1", 4,
+		{"d/w_del", "delay", "deltime", "feedback"},
+		{100, 100, 1, 100},
+		{"exp_sel1/2", "exp_sel2/2", "exp_sel3/2.1", "exp_sel4/2.1"},
+		{"/d/w_del_exp", "/delay_exp", "/deltime_exp", "/feedback_exp"}},
+	{"fx2.2", "/tape_delay_2", 4,
+		{"d/w_del", "delay", "ramptime", "rolloff"},
+		{100, 100, 1, 1},
+		{"exp_sel1/2", "exp_sel2/2", "exp_sel3/2.2", "exp_sel4/2.2"},
+		{"/d/w_del_2_exp", "/delay_2_exp", "/ramptime_exp", "/rolloff_exp"}},
+	{"fx3", "/freeverb", 4,
+		{"d/w_rev", "reverb", "revtime", "damping"},
+		{100, 100, 100, 100},
+		{"exp_sel1/3", "exp_sel2/3", "exp_sel3/3", "exp_sel4/3"},
+		{"/d/w_rev_exp", "/reverb_exp", "/revtime_exp", "/damping_exp"}},
+	{"fx4", "/looper", 1,
+		{"loop1"},
+		{100},
+		{},
+		{}},
+};
+enum { kOledNumPages = sizeof(gOledPages) / sizeof(gOledPages[0]) };
+
+class OledState
+{
+public:
+	void setup(float sampleRate)
+	{
+		// parameters and expression selectors can be shared between
+		// pages (e.g.: the two tape delay pages), so we store each of
+		// them once and refer to them by index
+		for(unsigned int p = 0; p < kOledNumPages; ++p)
+		{
+			for(unsigned int s = 0; s < kOledMaxSlots; ++s)
+			{
+				const OledPage& page = gOledPages[p];
+				slotParam[p][s] = s < page.numSlots ? addName(paramNames, page.params[s]) : -1;
+				if(slotParam[p][s] >= 0)
+				{
+					scales.resize(paramNames.size());
+					scales[slotParam[p][s]] = page.scales[s];
+				}
+				slotExpSel[p][s] = s < page.numSlots && page.expSelectors[s] ? addName(expSelNames, page.expSelectors[s]) : -1;
+			}
+		}
+		values.resize(paramNames.size(), 0);
+		shown.resize(paramNames.size(), 0);
+		expSelected.resize(expSelNames.size(), false);
+		startupHoldSamples = gOledStartupHoldMs * 0.001f * sampleRate;
+		holdSamples = startupHoldSamples;
+		minIntervalSamples = gOledMinIntervalMs * 0.001f * sampleRate;
+		samplesSinceSend = minIntervalSamples;
+		streamIntervalSamples = sampleRate / gOledStreamFps;
+		samplesPerColumn = gOledWaveformSeconds * sampleRate / kOledWaveformColumns;
+		gOledSender.setup(gOledRemotePort, gOledRemoteIp);
+	}
+
+	// forget the values of the previous patch: the new one sends its own
+	// while it initialises
+	void patchChanged()
+	{
+		std::fill(values.begin(), values.end(), 0);
+		std::fill(shown.begin(), shown.end(), 0);
+		std::fill(expSelected.begin(), expSelected.end(), false);
+		page = 0;
+		expActive = false;
+		blocked = false;
+		looping = false;
+		loopLength = 0;
+		loopSamples = 0;
+		dirty = true;
+	}
+
+	void bindReceivers()
+	{
+		for(unsigned int n = 0; n < paramNames.size(); ++n)
+			gHooks.bind(paramNames[n].c_str(), kHookOledParam, n);
+		for(unsigned int n = 0; n < expSelNames.size(); ++n)
+			gHooks.bind(expSelNames[n].c_str(), kHookOledExpSel, n);
+		for(unsigned int p = 0; p < kOledNumPages; ++p)
+			gHooks.bind(gOledPages[p].selector, kHookOledPage, p);
+		gHooks.bind("expIn", kHookOledExpIn);
+		gHooks.bind("expOut", kHookOledExpOut);
+		gHooks.bind("desel_oled", kHookOledDesel);
+		// looper state, for the position bar
+		gHooks.bind("new_length", kHookOledNewLength);
+		gHooks.bind("new_cycle", kHookOledNewCycle);
+		gHooks.bind("loop_on_off", kHookOledLoopOnOff);
+		gHooks.bind("stop_looping", kHookOledStopLooping);
+	}
+
+	// returns true if the message was for us
+	bool processFloat(const HookEntry& hook, float value)
+	{
+		unsigned int idx = hook.arg;
+		switch(hook.receiver)
+		{
+		case kHookOledParam:
+		{
+			values[idx] = value * scales[idx];
+			int digit = applyHysteresis(values[idx], shown[idx]);
+			if(digit != shown[idx])
+			{
+				shown[idx] = digit;
+				if(isVisible(idx))
+					dirty = true;
+			}
+			return true;
+		}
+		case kHookOledExpSel:
+			if(expSelected[idx] != bool(value))
+			{
+				expSelected[idx] = value;
+				dirty = true;
+			}
+			return true;
+		case kHookOledPage:
+			if(1 == value && int(idx) != page)
+			{
+				page = idx;
+				dirty = true;
+			}
+			return true;
+		case kHookOledDesel:
+		{
+			// the screen is blocked while the GUI is called up
+			bool shouldBlock = (0 == value);
+			if(shouldBlock && !blocked)
+			{
+				newMessage("/desel_oled").send();
+			}
+			if(!shouldBlock && blocked)
+				dirty = true;
+			blocked = shouldBlock;
+			return true;
+		}
+		case kHookOledNewLength:
+			// the looper measures its length with [timer 1 sample]
+			loopLength = value;
+			loopSamples = 0;
+			return true;
+		case kHookOledLoopOnOff:
+			looping = value;
+			loopSamples = 0;
+			return true;
+		}
+		return false;
+	}
+
+	bool processBang(const HookEntry& hook)
+	{
+		switch(hook.receiver)
+		{
+		case kHookOledNewCycle:
+			loopSamples = 0;
+			return true;
+		case kHookOledStopLooping:
+			looping = false;
+			return true;
+		case kHookOledExpIn:
+			expActive = true;
+			dirty = true;
+			return true;
+		case kHookOledExpOut:
+			expActive = false;
+			dirty = true;
+			return true;
+		}
+		return false;
+	}
+
+	// call once per audio callback, after the output has been computed
+	void processAudio(BelaContext* context)
+	{
+		const float* in = context->audioIn;
+		const float* outL = context->audioOut;
+		const float* outR = context->audioOutChannels > 1 ? context->audioOut + context->audioFrames : outL;
+		for(unsigned int n = 0; n < context->audioFrames; ++n)
+		{
+			if(context->audioInChannels)
+				inPeak = std::max(inPeak, fabsf(in[n]));
+			outPeak = std::max(outPeak, std::max(fabsf(outL[n]), fabsf(outR[n])));
+			float out = outL[n];
+			columnMin = std::min(columnMin, out);
+			columnMax = std::max(columnMax, out);
+			if(++columnSamples >= samplesPerColumn)
+			{
+				int8_t* column = columns[columnsWritten % kOledWaveformColumns];
+				column[0] = quantise(columnMin);
+				column[1] = quantise(columnMax);
+				++columnsWritten;
+				columnSamples = 0;
+				columnMin = 1;
+				columnMax = -1;
+			}
+		}
+		if(looping)
+			loopSamples += context->audioFrames;
+		samplesSinceStream += context->audioFrames;
+		if(samplesSinceStream < streamIntervalSamples || holdSamples > 0 || blocked)
+			return;
+		samplesSinceStream = 0;
+		publishStream();
+	}
+
+	// call once per audio callback
+	void process(unsigned int frames)
+	{
+		if(holdSamples > 0)
+		{
+			holdSamples -= frames;
+			if(holdSamples > 0)
+				return;
+			// show whatever the patch has initialised
+			dirty = true;
+		}
+		samplesSinceSend += frames;
+		if(!dirty || blocked || page < 0)
+			return;
+		if(samplesSinceSend < minIntervalSamples)
+			return;
+		publish();
+		dirty = false;
+		samplesSinceSend = 0;
+	}
+
+private:
+	static int addName(std::vector<std::string>& names, const char* name)
+	{
+		int idx = findName(names, name);
+		if(idx >= 0)
+			return idx;
+		names.emplace_back(name);
+		return names.size() - 1;
+	}
+
+	static int findName(const std::vector<std::string>& names, const char* name)
+	{
+		for(unsigned int n = 0; n < names.size(); ++n)
+		{
+			if(0 == strcmp(name, names[n].c_str()))
+				return n;
+		}
+		return -1;
+	}
+
+	static int applyHysteresis(float value, int digit)
+	{
+		if(fabsf(value - digit) < 0.5f + gOledHysteresis)
+			return digit;
+		return (int)roundf(value);
+	}
+
+	// the slot currently replaced by "[exp]" on the active page, or -1
+	int expSlot()
+	{
+		if(!expActive || page < 0)
+			return -1;
+		for(unsigned int s = 0; s < gOledPages[page].numSlots; ++s)
+		{
+			int sel = slotExpSel[page][s];
+			if(sel >= 0 && expSelected[sel])
+				return s;
+		}
+		return -1;
+	}
+
+	bool isVisible(int param)
+	{
+		if(page < 0)
+			return false;
+		int exp = expSlot();
+		for(unsigned int s = 0; s < gOledPages[page].numSlots; ++s)
+		{
+			if(slotParam[page][s] == param && int(s) != exp)
+				return true;
+		}
+		return false;
+	}
+
+	static int8_t quantise(float value)
+	{
+		return roundf(std::min(1.f, std::max(-1.f, value)) * 127);
+	}
+
+	// every message starts with a blob holding the time it was sent (in
+	// microseconds on CLOCK_MONOTONIC) and a sequence number, so that the
+	// OLED program can report the end-to-end latency and any lost messages
+	OscSender& newMessage(const char* address)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		uint64_t time = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+		memcpy(stamp, &time, sizeof(time));
+		memcpy(stamp + sizeof(time), &sequence, sizeof(sequence));
+		++sequence;
+		return gOledSender.newMessage(address).add(stamp, sizeof(stamp));
+	}
+
+	void publishStream()
+	{
+		// if we have fallen behind (e.g.: while blocked), skip the oldest columns
+		if(columnsWritten - columnsSent > kOledMaxColumnsPerFrame)
+			columnsSent = columnsWritten - kOledMaxColumnsPerFrame;
+		unsigned int numColumns = columnsWritten - columnsSent;
+		for(unsigned int n = 0; n < numColumns; ++n)
+		{
+			const int8_t* column = columns[(columnsSent + n) % kOledWaveformColumns];
+			streamBuffer[2 * n] = column[0];
+			streamBuffer[2 * n + 1] = column[1];
+		}
+		float loopPosition = -1;
+		if(looping && loopLength > 0)
+			loopPosition = std::min(1.f, loopSamples / loopLength);
+		// /stream <inPeak> <outPeak> <loopPosition> <firstColumn> <min/max blob>
+		newMessage("/stream")
+			.add(inPeak)
+			.add(outPeak)
+			.add(loopPosition)
+			.add(int(columnsSent))
+			.add(streamBuffer, 2 * numColumns)
+			.send();
+		columnsSent = columnsWritten;
+		inPeak = 0;
+		outPeak = 0;
+	}
+
+	void publish()
+	{
+		const OledPage& p = gOledPages[page];
+		int exp = expSlot();
+		newMessage(exp >= 0 ? p.expAddresses[exp] : p.address);
+		for(unsigned int s = 0; s < p.numSlots; ++s)
+			gOledSender.add(shown[slotParam[page][s]]);
+		gOledSender.send();
+	}
+
+	std::vector<std::string> paramNames;
+	std::vector<std::string> expSelNames;
+	std::vector<float> scales;
+	std::vector<float> values;
+	std::vector<int> shown;
+	std::vector<bool> expSelected;
+	int slotParam[kOledNumPages][kOledMaxSlots];
+	int slotExpSel[kOledNumPages][kOledMaxSlots];
+	int page = 0;
+	bool expActive = false;
+	bool blocked = false;
+	bool dirty = false;
+	int holdSamples = 0;
+	int startupHoldSamples = 0;
+	int minIntervalSamples = 0;
+	int samplesSinceSend = 0;
+
+	int8_t columns[kOledWaveformColumns][2] = {};
+	int8_t streamBuffer[2 * kOledMaxColumnsPerFrame];
+	uint32_t columnsWritten = 0;
+	uint32_t columnsSent = 0;
+	float columnMin = 1;
+	float columnMax = -1;
+	int columnSamples = 0;
+	int samplesPerColumn = 1;
+	float inPeak = 0;
+	float outPeak = 0;
+	int streamIntervalSamples = 0;
+	int samplesSinceStream = 0;
+	float loopLength = 0;
+	float loopSamples = 0;
+	bool looping = false;
+	char stamp[sizeof(uint64_t) + sizeof(uint32_t)];
+	uint32_t sequence = 0;
+};
+static OledState gOledState;
+#endif // BELA_LIBPD_OLED
+
+enum { minFirstDigitalChannel = 10 };
+static unsigned int gAnalogChannelsInUse;
+static unsigned int gDigitalChannelsInUse;
 #ifdef BELA_LIBPD_SCOPE
-static unsigned int gScopeChannelsInUse = 4;
+static unsigned int gScopeChannelsInUse = 4; // more if the patch uses them, see scopeChannelsInPatch()
 #else // BELA_LIBPD_SCOPE
 static unsigned int gScopeChannelsInUse = 0;
 #endif // BELA_LIBPD_SCOPE
@@ -303,6 +1767,160 @@ static unsigned int gFirstDigitalChannel;
 static unsigned int gLibpdDigitalChannelOffset;
 static unsigned int gFirstScopeChannel;
 
+#ifdef BELA_LIBPD_SCOPE
+// The scope channels are contiguous in gOutBuf, so the audio thread hands
+// each block over to scopeLoop() with a single pipe write, and only while a
+// browser is connected to the scope. scopeLoop() interleaves the frames,
+// keeps one every gScopeDecimation (the time axis of the scope is then
+// stretched by the same factor), marks the frames where the first channel
+// crosses gScopeTriggerLevel upwards and sends them back to render(), which
+// is where the Scope expects to be fed: scopeLog() logs them and fires the
+// scope's custom trigger.
+// [decimate <n>(, [trigger <level>( and [trigger off( to bela_setScope set
+// these.
+enum {
+	// Scope keeps its websocket server to itself and has no connection
+	// callback, so scopeClientConnected() looks for a client on the port
+	// that Scope.cpp hard-codes. Keep the two in sync.
+	kScopePort = 5432,
+	kScopeMaxChannels = 8,
+	kScopeMaxBlock = 1024,
+};
+struct ScopeFrame
+{
+	float values[kScopeMaxChannels];
+	bool trigger;
+};
+Scope scope;
+Pipe gScopePipe; // render() to scopeLoop(): one block of the scope channels
+Pipe gScopeLogPipe; // scopeLoop() to render(): the decimated frames
+AuxiliaryTask gScopeTask;
+std::atomic<bool> gScopeConnected(false);
+std::atomic<unsigned int> gScopeDecimation(1);
+std::atomic<bool> gScopeTriggerEnabled(false);
+std::atomic<float> gScopeTriggerLevel(0);
+
+// The scope channels are processed by Pd whether or not they are used, so
+// only go beyond the default 4 if a [dac~] in one of the project's patches
+// addresses a channel past them. firstChannel is 0-based, [dac~] is 1-based.
+static unsigned int scopeChannelsInPatch(unsigned int firstChannel, const char* folder)
+{
+	unsigned int channels = gScopeChannelsInUse;
+	DIR* dir = opendir(folder);
+	if(!dir)
+		return channels;
+	struct dirent* entry;
+	while((entry = readdir(dir)))
+	{
+		std::string name = entry->d_name;
+		if(name.size() < 4 || name.compare(name.size() - 3, 3, ".pd"))
+			continue;
+		std::ifstream file(std::string(folder) + name);
+		std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		for(size_t pos = content.find(" dac~"); pos != std::string::npos; pos = content.find(" dac~", pos + 1))
+		{
+			const char* c = content.c_str() + pos + 5;
+			char* end;
+			for(long ch = strtol(c, &end, 10); end != c; ch = strtol(c, &end, 10))
+			{
+				if(ch > (long)firstChannel)
+					channels = std::max(channels, (unsigned int)(ch - firstChannel));
+				c = end;
+			}
+		}
+	}
+	closedir(dir);
+	if(channels > kScopeMaxChannels)
+	{
+		fprintf(stderr, "The patch uses %u scope channels, only %u are available\n", channels, kScopeMaxChannels);
+		channels = kScopeMaxChannels;
+	}
+	return channels;
+}
+
+// looks for established TCP connections to the scope's port. If the
+// connections cannot be listed, assume a client so that the scope still works
+static bool scopeClientConnected()
+{
+	const char* paths[] = {"/proc/net/tcp", "/proc/net/tcp6"};
+	bool listed = false;
+	for(const char* path : paths)
+	{
+		FILE* file = fopen(path, "r");
+		if(!file)
+			continue;
+		listed = true;
+		char line[256];
+		bool found = false;
+		while(!found && fgets(line, sizeof(line), file))
+		{
+			char local[64];
+			unsigned int state;
+			if(2 != sscanf(line, " %*d: %63s %*s %x", local, &state))
+				continue; // header
+			const char* port = strrchr(local, ':');
+			found = port && kScopePort == strtoul(port + 1, nullptr, 16) && 1 == state; // TCP_ESTABLISHED
+		}
+		fclose(file);
+		if(found)
+			return true;
+	}
+	return !listed;
+}
+
+void scopeLoop(void*)
+{
+	static float block[kScopeMaxBlock];
+	ScopeFrame frame;
+	unsigned int phase = 0;
+	float previous = 0;
+	struct timespec lastCheck = {0, 0};
+	gScopePipe.setBlockingNonRt(true);
+	gScopePipe.setTimeoutMsNonRt(100);
+	while(!Bela_stopRequested())
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec != lastCheck.tv_sec)
+		{
+			lastCheck = now;
+			gScopeConnected = scopeClientConnected();
+		}
+		int ret = gScopePipe.readNonRt(block, kScopeMaxBlock);
+		if(ret <= 0)
+			continue;
+		unsigned int frames = ret / gScopeChannelsInUse;
+		unsigned int decimation = gScopeDecimation;
+		bool trigger = gScopeTriggerEnabled;
+		float level = gScopeTriggerLevel;
+		for(unsigned int f = 0; f < frames; ++f)
+		{
+			if(++phase < decimation)
+				continue;
+			phase = 0;
+			for(unsigned int c = 0; c < gScopeChannelsInUse; ++c)
+				frame.values[c] = block[c * frames + f];
+			frame.trigger = trigger && previous < level && frame.values[0] >= level;
+			previous = frame.values[0];
+			gScopeLogPipe.writeNonRt(frame);
+		}
+	}
+}
+
+// logs the frames prepared by scopeLoop(). Decimation never produces more
+// than one frame per input frame, so one callback's worth is enough to keep up
+static void scopeLog(BelaContext* context)
+{
+	ScopeFrame frame;
+	for(unsigned int n = 0; n < context->audioFrames && gScopeLogPipe.readRt(frame) > 0; ++n)
+	{
+		if(frame.trigger)
+			scope.trigger();
+		scope.log(frame.values);
+	}
+}
+#endif // BELA_LIBPD_SCOPE
+
 void Bela_userSettings(BelaInitSettings *settings)
 {
 	settings->uniformSampleRate = 1;
@@ -388,6 +2006,8 @@ static unsigned int getPortChannel(int* channel){
 }
 
 void Bela_MidiOutNoteOn(int channel, int pitch, int velocity) {
+	if(midiHookHeld(DeferredHook::kNoteOn, channel, pitch, velocity))
+		return;
 	unsigned int port = getPortChannel(&channel);
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("noteout _ port: %d, channel: %d, pitch: %d, velocity %d\n", port, channel, pitch, velocity);
@@ -395,6 +2015,8 @@ void Bela_MidiOutNoteOn(int channel, int pitch, int velocity) {
 }
 
 void Bela_MidiOutControlChange(int channel, int controller, int value) {
+	if(midiHookHeld(DeferredHook::kControlChange, channel, controller, value))
+		return;
 	unsigned int port = getPortChannel(&channel);
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("ctlout _ port: %d, channel: %d, controller: %d, value: %d\n", port, channel, controller, value);
@@ -402,6 +2024,8 @@ void Bela_MidiOutControlChange(int channel, int controller, int value) {
 }
 
 void Bela_MidiOutProgramChange(int channel, int program) {
+	if(midiHookHeld(DeferredHook::kProgramChange, channel, program))
+		return;
 	unsigned int port = getPortChannel(&channel);
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("pgmout _ port: %d, channel: %d, program: %d\n", port, channel, program);
@@ -409,6 +2033,8 @@ void Bela_MidiOutProgramChange(int channel, int program) {
 }
 
 void Bela_MidiOutPitchBend(int channel, int value) {
+	if(midiHookHeld(DeferredHook::kPitchBend, channel, value))
+		return;
 	unsigned int port = getPortChannel(&channel);
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("bendout _ port: %d, channel: %d, value: %d\n", port, channel, value);
@@ -417,6 +2043,8 @@ void Bela_MidiOutPitchBend(int channel, int value) {
 }
 
 void Bela_MidiOutAftertouch(int channel, int pressure){
+	if(midiHookHeld(DeferredHook::kAftertouch, channel, pressure))
+		return;
 	unsigned int port = getPortChannel(&channel);
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("touchout _ port: %d, channel: %d, pressure: %d\n", port, channel, pressure);
@@ -424,6 +2052,8 @@ void Bela_MidiOutAftertouch(int channel, int pressure){
 }
 
 void Bela_MidiOutPolyAftertouch(int channel, int pitch, int pressure){
+	if(midiHookHeld(DeferredHook::kPolyAftertouch, channel, pitch, pressure))
+		return;
 	unsigned int port = getPortChannel(&channel);
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("polytouchout _ port: %d, channel: %d, pitch: %d, pressure: %d\n", port, channel, pitch, pressure);
@@ -431,6 +2061,8 @@ void Bela_MidiOutPolyAftertouch(int channel, int pitch, int pressure){
 }
 
 void Bela_MidiOutByte(int port, int byte){
+	if(midiHookHeld(DeferredHook::kMidiByte, port, byte))
+		return;
 	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 		rt_printf("port: %d, byte: %d\n", port, byte);
 	if(port > (int)midi.size()){
@@ -440,414 +2072,2463 @@ void Bela_MidiOutByte(int port, int byte){
 	}
 	port < (int)midi.size() && midi[port]->writeOutput(byte);
 }
-#endif // BELA_LIBPD_MIDI
 
-void Bela_printHook(const char *received){
-	rt_printf("%s", received);
-}
+// Incoming MIDI is parsed on each port's input thread and queued, together
+// with the time it was received, in a lock-free queue per port. render()
+// dispatches at most kMidiMaxEventsPerBlock events per callback, each in the
+// Pd tick matching its arrival time within the previous callback period:
+// one block of latency, but no jitter.
+enum {
+	kMidiMaxPorts = 16,
+	kMidiQueueSize = 512,
+	kMidiMaxEventsPerBlock = 64,
+};
+struct MidiEvent
+{
+	uint64_t time; // ns, CLOCK_MONOTONIC
+	MidiChannelMessage message;
+};
 
-static DigitalChannelManager dcm;
+// single producer (the port's input thread), single consumer (the audio thread)
+class MidiEventQueue
+{
+public:
+	bool push(const MidiEvent& event)
+	{
+		unsigned int write = writePtr.load(std::memory_order_relaxed);
+		unsigned int next = (write + 1) % kMidiQueueSize;
+		if(next == readPtr.load(std::memory_order_acquire))
+			return false;
+		events[write] = event;
+		writePtr.store(next, std::memory_order_release);
+		return true;
+	}
 
-void sendDigitalMessage(bool state, unsigned int delay, void* receiverName){
-	libpd_float((const char*)receiverName, (float)state);
-//	rt_printf("%s: %d\n", (char*)receiverName, state);
+	MidiEvent* front()
+	{
+		unsigned int read = readPtr.load(std::memory_order_relaxed);
+		if(read == writePtr.load(std::memory_order_acquire))
+			return nullptr;
+		return &events[read];
+	}
+
+	void pop()
+	{
+		readPtr.store((readPtr.load(std::memory_order_relaxed) + 1) % kMidiQueueSize, std::memory_order_release);
+	}
+
+private:
+	MidiEvent events[kMidiQueueSize];
+	std::atomic<unsigned int> writePtr{0};
+	std::atomic<unsigned int> readPtr{0};
+};
+
+static MidiEventQueue gMidiQueues[kMidiMaxPorts];
+static std::atomic<unsigned int> gMidiDroppedEvents(0);
+static uint64_t gMidiBlockTime = 0; // when the current callback started
+static uint64_t gMidiPrevBlockTime = 0;
+
+static uint64_t midiNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-#ifdef BELA_LIBPD_TRILL
-void setTrillPrintError()
+static void midiInputCallback(MidiChannelMessage message, void* arg)
 {
-	rt_fprintf(stderr, "bela_setTrill format is wrong. Should be:\n"
-		"[mode <sensor_id> <prescaler_value>(\n"
-		" or\n"
-		"[threshold <sensor_id> <threshold_value>(\n"
-		" or\n"
-		"[prescaler <sensor_id> <prescaler_value>(\n");
+	unsigned int port = (uintptr_t)arg;
+	if(!gMidiQueues[port].push(MidiEvent{midiNow(), message}))
+		++gMidiDroppedEvents;
 }
-#endif // BELA_LIBPD_TRILL
 
-void Bela_listHook(const char *source, int argc, t_atom *argv)
+// the device of [<type> <card> <device> <subdevice>( to bela_setMidi,
+// e.g.: [hw 1 0 0( for hw:1,0,0
+static bool midiDeviceName(const char* symbol, int argc, t_atom* argv, std::string& name)
 {
-#ifdef BELA_LIBPD_GUI
-	if(0 == strcmp(source, "bela_guiOut"))
+	int num[3] = {0, 0, 0};
+	for(int n = 0; n < argc && n < 3; ++n)
 	{
-		if(!libpd_is_float(&argv[0]))
+		if(!libpd_is_float(&argv[n]))
 		{
-			rt_fprintf(stderr, "Wrong format for bela_gui, the first element should be a float\n");
-			return;
-		}
-		unsigned int bufNum = libpd_get_float(&argv[0]);
-		if(libpd_is_float(&argv[1])) // if the first element is a float, we send an array of floats
-		{
-			float buf[argc - 1];
-			for(int n = 1; n < argc; ++n)
-			{
-				t_atom *a = &argv[n];
-				if(!libpd_is_float(a))
-				{
-					rt_fprintf(stderr, "Wrong format for bela_gui\n"); // this should never happen, because then the selector would've not been "float"
-					return;
-				}
-				buf[n - 1] = libpd_get_float(a);
-			}
-			gui.sendBuffer(bufNum, buf, argc - 1);
-			return;
-		} else { // otherwise we send each element of the list separately
-			for(int n = 1; n < argc; ++n)
-			{
-				t_atom *a = &argv[n];
-				if (libpd_is_float(a)) {
-					float x = libpd_get_float(a);
-					gui.sendBuffer(bufNum, x);
-				} else if (libpd_is_symbol(a)) {
-					const char *s = libpd_get_symbol(a);
-					gui.sendBuffer(bufNum, s, strlen(s)); // TODO: should it be strlen(s)+1?
-				}
-			}
+			fprintf(stderr, "Wrong format for bela_setMidi, expected:[hw 1 0 0(");
+			return false;
 		}
+		num[n] = libpd_get_float(&argv[n]);
+	}
+	std::ostringstream deviceName;
+	deviceName << symbol << ":" << num[0] << "," << num[1] << "," << num[2];
+	name = deviceName.str();
+	return true;
+}
+
+// call after adding a port to midi
+static void midiListen(unsigned int port)
+{
+	if(port >= kMidiMaxPorts)
+	{
+		fprintf(stderr, "Too many MIDI ports: input from port %u will be ignored\n", port);
 		return;
 	}
-#endif // BELA_LIBPD_GUI
+	midi[port]->setParserCallback(midiInputCallback, (void*)(uintptr_t)port);
 }
-void Bela_messageHook(const char *source, const char *symbol, int argc, t_atom *argv){
-#ifdef BELA_LIBPD_MIDI
-	if(strcmp(source, "bela_setMidi") == 0)
+
+// Follows an incoming MIDI clock (24 pulses per quarter note) with a
+// second-order PLL running on the audio frame counter, so that the tempo
+// and phase are not affected by the jitter of individual clock bytes.
+class MidiClockFollower
+{
+public:
+	static constexpr unsigned int kPpqn = 24;
+
+	void setup(float sampleRate)
 	{
-		if(0 == strcmp("verbose", symbol))
+		this->sampleRate = sampleRate;
+	}
+
+	void start()
+	{
+		pulses = 0;
+		running = true;
+	}
+
+	void resume()
+	{
+		running = true;
+	}
+
+	void stop()
+	{
+		running = false;
+	}
+
+	// returns true if this pulse starts a new beat
+	bool pulse(double frame)
+	{
+		if(locked && frame - lastFrame > kTimeoutPeriods * period)
 		{
-			if(1 != argc || !libpd_is_float(argv))
+			// the clock stopped for a while: start over
+			locked = false;
+			haveLast = false;
+		}
+		if(!haveLast) {
+			haveLast = true;
+		} else if(!locked) {
+			period = frame - lastFrame;
+			predicted = frame;
+			locked = period > 0;
+		} else {
+			predicted += period;
+			double error = frame - predicted;
+			if(fabs(error) > 0.5 * period)
 			{
-				rt_fprintf(stderr, "Wrong format for bela_setMidi, expected: [verbose <n>(\n");
+				// tempo jump: too far off to track, resync
+				period = frame - lastFrame;
+				predicted = frame;
 			} else {
-				gMidiVerbose = libpd_get_float(argv);
-				rt_printf("MIDI verbose: %d\n", gMidiVerbose);
+				predicted += kPhaseGain * error;
+				period += kPeriodGain * error;
 			}
-			return;
 		}
-		int num[3] = {0, 0, 0};
-		for(int n = 0; n < argc && n < 3; ++n)
+		lastFrame = frame;
+		++pulses;
+		return running && (pulses - 1) % kPpqn == 0;
+	}
+
+	bool isLocked(double frame) const
+	{
+		return locked && frame - lastFrame < kTimeoutPeriods * period;
+	}
+
+	bool isRunning() const
+	{
+		return running;
+	}
+
+	// beats per minute
+	float getTempo() const
+	{
+		return locked ? 60. * sampleRate / (kPpqn * period) : 0;
+	}
+
+	// beats since the last start message
+	unsigned int getBeat() const
+	{
+		return pulses ? (pulses - 1) / kPpqn : 0;
+	}
+
+	// position within the current beat, in [0, 1)
+	float getPhase(double frame) const
+	{
+		if(!locked || !pulses)
+			return 0;
+		double fraction = std::min(std::max((frame - predicted) / period, 0.), 0.999);
+		return (((pulses - 1) % kPpqn) + fraction) / kPpqn;
+	}
+
+private:
+	static constexpr double kPhaseGain = 0.1;
+	static constexpr double kPeriodGain = 0.01;
+	static constexpr double kTimeoutPeriods = 8;
+	float sampleRate = 44100;
+	double period = 0; // frames per pulse
+	double predicted = 0; // estimated frame of the latest pulse
+	double lastFrame = 0;
+	unsigned int pulses = 0;
+	bool haveLast = false;
+	bool locked = false;
+	bool running = false;
+};
+
+static MidiClockFollower gMidiClock;
+static float gMidiClockSync = 0; // delay time in beats, 0 for free-running
+static float gMidiClockTempoSent = 0;
+static float gMidiClockDelaySent = 0;
+
+static void midiClockEvent(int byte, double frame)
+{
+	switch(byte)
+	{
+		case 0xF8:
+			if(gMidiClock.pulse(frame))
+				libpd_float("bela_midiBeat", gMidiClock.getBeat());
+			break;
+		case 0xFA:
+			gMidiClock.start();
+			libpd_float("bela_midiRunning", 1);
+			break;
+		case 0xFB:
+			gMidiClock.resume();
+			libpd_float("bela_midiRunning", 1);
+			break;
+		case 0xFC:
+			gMidiClock.stop();
+			libpd_float("bela_midiRunning", 0);
+			break;
+	}
+}
+
+// called once per block: publish tempo changes and keep the delay locked to it
+static void midiClockUpdate(double frame)
+{
+	float tempo = gMidiClock.isLocked(frame) ? gMidiClock.getTempo() : 0;
+	if(fabsf(tempo - gMidiClockTempoSent) < 0.05f)
+		return;
+	gMidiClockTempoSent = tempo;
+	libpd_float("bela_midiTempo", tempo);
+	if(tempo && gMidiClockSync > 0)
+	{
+		float delay = std::min(std::max(60000.f / tempo * gMidiClockSync, 10.f), 2000.f);
+		if(fabsf(delay - gMidiClockDelaySent) >= 0.5f)
 		{
-			if(!libpd_is_float(&argv[n]))
-			{
-				fprintf(stderr, "Wrong format for bela_setMidi, expected:[hw 1 0 0(");
-				return;
-			}
-			num[n] = libpd_get_float(&argv[n]);
+			gMidiClockDelaySent = delay;
+			libpd_float("deltime", delay);
 		}
-		std::ostringstream deviceName;
-		deviceName << symbol << ":" << num[0] << "," << num[1] << "," << num[2];
-		printf("Adding Midi device: %s\n", deviceName.str().c_str());
-		Midi* newMidi = openMidiDevice(deviceName.str(), false, true);
-		if(newMidi)
+	}
+}
+
+// MIDI learn: [learn <param>( to bela_midiLearn binds the next controller
+// that moves (a 7-bit CC, a 14-bit CC pair or an NRPN) to a parameter,
+// [forget <param>( and [clear( remove bindings and [cancel( stops learning.
+// Mapped controllers are scaled to the parameter's range and sent straight
+// to its receiver instead of going through Pd's [ctlin]. The table is
+// written to gMidiLearnFile by midiLearnSaveLoop() whenever it changes.
+const char* gMidiLearnFile = "midi-learn.txt";
+struct MidiLearnParam
+{
+	const char* name;
+	float min;
+	float max;
+};
+// same ranges as the [encoder] abstractions in interface.pd
+static const MidiLearnParam gMidiLearnParams[] = {
+	{"d/w_scn", 0, 1},
+	{"scanner", 0, 1},
+	{"rate", 0, 1},
+	{"depth", 0, 1},
+	{"d/w_del", 0, 1},
+	{"delay", 0, 1},
+	{"deltime", 10, 2000},
+	{"feedback", 0, 1},
+	{"ramptime", 5, 2000},
+	{"rolloff", 30, 150},
+	{"d/w_rev", 0, 1},
+	{"reverb", 0, 1},
+	{"revtime", 0, 1},
+	{"damping", 0, 1},
+	{"loop1", 0, 1},
+};
+enum {
+	kMidiLearnNumParams = sizeof(gMidiLearnParams) / sizeof(gMidiLearnParams[0]),
+	kMidiLearnMaxMappings = 64,
+	kMidiLearnNumChannels = kMidiMaxPorts * 16,
+	kMidiLearnNoNrpn = 0x3fff, // NRPN 127/127 is the "null" parameter
+};
+enum MidiLearnType {
+	kMidiLearnCc,
+	kMidiLearnCc14,
+	kMidiLearnNrpn,
+	kMidiLearnNumTypes,
+};
+static const char* gMidiLearnTypeNames[kMidiLearnNumTypes] = {"cc", "cc14", "nrpn"};
+struct MidiLearnMapping
+{
+	uint8_t type;
+	uint8_t param;
+	uint16_t channel; // port * 16 + channel
+	uint16_t number; // controller (MSB for cc14) or NRPN number
+};
+struct MidiLearnChannelState
+{
+	uint8_t msb[32] = {};
+	uint8_t lsb[32] = {};
+	uint16_t nrpn = kMidiLearnNoNrpn;
+	uint8_t dataMsb = 0;
+	uint8_t dataLsb = 0;
+};
+
+static MidiLearnMapping gMidiLearnMappings[kMidiLearnMaxMappings];
+static unsigned int gMidiLearnNumMappings = 0;
+static MidiLearnChannelState gMidiLearnState[kMidiLearnNumChannels];
+static int gMidiLearnArmed = -1; // parameter waiting for a controller
+static int gMidiLearnLast = -1; // mapping just learned, may still become cc14
+static Pipe gMidiLearnPipe;
+static AuxiliaryTask gMidiLearnTask;
+
+static int midiLearnFindParam(const char* name)
+{
+	for(unsigned int n = 0; n < kMidiLearnNumParams; ++n)
+		if(0 == strcmp(name, gMidiLearnParams[n].name))
+			return n;
+	return -1;
+}
+
+static int midiLearnFind(unsigned int type, unsigned int channel, unsigned int number)
+{
+	for(unsigned int n = 0; n < gMidiLearnNumMappings; ++n)
+	{
+		const MidiLearnMapping& m = gMidiLearnMappings[n];
+		if(m.type == type && m.channel == channel && m.number == number)
+			return n;
+	}
+	return -1;
+}
+
+static void midiLearnRemove(unsigned int idx)
+{
+	gMidiLearnMappings[idx] = gMidiLearnMappings[--gMidiLearnNumMappings];
+	gMidiLearnLast = -1;
+}
+
+// the whole table is sent as one message, so that an empty one is saved too
+struct MidiLearnTable
+{
+	uint32_t numMappings;
+	MidiLearnMapping mappings[kMidiLearnMaxMappings];
+};
+
+// call from the audio thread after changing the table
+static void midiLearnSave()
+{
+	if(!gMidiLearnTask)
+		return;
+	static MidiLearnTable table;
+	table.numMappings = gMidiLearnNumMappings;
+	memcpy(table.mappings, gMidiLearnMappings, sizeof(gMidiLearnMappings[0]) * gMidiLearnNumMappings);
+	if(!gMidiLearnPipe.writeRt(table))
+		rt_fprintf(stderr, "MIDI learn: could not save the mappings\n");
+}
+
+static void midiLearnSaveLoop(void*)
+{
+	static MidiLearnTable table;
+	gMidiLearnPipe.setTimeoutMsNonRt(100);
+	while(!Bela_stopRequested())
+	{
+		gMidiLearnPipe.setBlockingNonRt(true);
+		if(gMidiLearnPipe.readNonRt(table) <= 0)
+			continue;
+		// only the latest table matters
+		gMidiLearnPipe.setBlockingNonRt(false);
+		while(gMidiLearnPipe.readNonRt(table) > 0)
+			;
+		FILE* file = fopen(gMidiLearnFile, "w");
+		if(!file)
 		{
-			midi.push_back(newMidi);
-			gMidiPortNames.push_back(deviceName.str());
+			fprintf(stderr, "MIDI learn: cannot write %s\n", gMidiLearnFile);
+			continue;
 		}
-		dumpMidi();
+		for(unsigned int n = 0; n < table.numMappings && n < kMidiLearnMaxMappings; ++n)
+		{
+			const MidiLearnMapping& m = table.mappings[n];
+			fprintf(file, "%s %u %u %s\n", gMidiLearnTypeNames[m.type], m.channel, m.number, gMidiLearnParams[m.param].name);
+		}
+		fclose(file);
+	}
+}
+
+static void midiLearnLoad()
+{
+	FILE* file = fopen(gMidiLearnFile, "r");
+	if(!file)
 		return;
+	char type[16];
+	char name[64];
+	unsigned int channel;
+	unsigned int number;
+	while(gMidiLearnNumMappings < kMidiLearnMaxMappings && 4 == fscanf(file, "%15s %u %u %63s", type, &channel, &number, name))
+	{
+		int t = -1;
+		for(unsigned int n = 0; n < kMidiLearnNumTypes; ++n)
+			if(0 == strcmp(type, gMidiLearnTypeNames[n]))
+				t = n;
+		int param = midiLearnFindParam(name);
+		if(t < 0 || param < 0 || channel >= kMidiLearnNumChannels || number > 0x3fff)
+		{
+			fprintf(stderr, "MIDI learn: ignoring %s %u %u %s in %s\n", type, channel, number, name, gMidiLearnFile);
+			continue;
+		}
+		gMidiLearnMappings[gMidiLearnNumMappings++] = MidiLearnMapping{uint8_t(t), uint8_t(param), uint16_t(channel), uint16_t(number)};
 	}
-#endif // BELA_LIBPD_MIDI
-	if(strcmp(source, "bela_setDigital") == 0){
-		// symbol is the direction, argv[0] is the channel, argv[1] (optional)
-		// is signal("sig" or "~") or message("message", default) rate
-		bool isMessageRate = true; // defaults to message rate
-		bool direction = 0; // initialize it just to avoid the compiler's warning
-		bool disable = false;
-		if(strcmp(symbol, "in") == 0){
-			direction = INPUT;
-		} else if(strcmp(symbol, "out") == 0){
-			direction = OUTPUT;
-		} else if(strcmp(symbol, "disable") == 0){
-			disable = true;
-		} else {
+	fclose(file);
+	printf("MIDI learn: %u mappings loaded from %s\n", gMidiLearnNumMappings, gMidiLearnFile);
+}
+
+static void midiLearnBind(unsigned int type, unsigned int channel, unsigned int number)
+{
+	int idx = midiLearnFind(type, channel, number);
+	if(idx < 0)
+	{
+		if(gMidiLearnNumMappings >= kMidiLearnMaxMappings)
+		{
+			rt_fprintf(stderr, "MIDI learn: too many mappings\n");
+			gMidiLearnArmed = -1;
 			return;
 		}
-		if(argc == 0){
-			return;
-		} else if (libpd_is_float(&argv[0]) == false){
-			return;
+		idx = gMidiLearnNumMappings++;
+	}
+	gMidiLearnMappings[idx] = MidiLearnMapping{uint8_t(type), uint8_t(gMidiLearnArmed), uint16_t(channel), uint16_t(number)};
+	rt_printf("MIDI learn: %s %u on port %u channel %u -> %s\n", gMidiLearnTypeNames[type], number,
+		channel / 16, channel % 16, gMidiLearnParams[gMidiLearnArmed].name);
+	libpd_symbol("bela_midiLearned", gMidiLearnParams[gMidiLearnArmed].name);
+	gMidiLearnArmed = -1;
+	gMidiLearnLast = idx;
+	midiLearnSave();
+}
+
+static void midiLearnApply(int idx, float normalised)
+{
+	const MidiLearnParam& p = gMidiLearnParams[gMidiLearnMappings[idx].param];
+	libpd_float(p.name, p.min + normalised * (p.max - p.min));
+}
+
+// returns true if the controller was consumed by a mapping
+static bool midiLearnControlChange(unsigned int channel, unsigned int controller, unsigned int value)
+{
+	if(channel >= kMidiLearnNumChannels)
+		return false;
+	MidiLearnChannelState& s = gMidiLearnState[channel];
+	switch(controller)
+	{
+		case 99:
+			s.nrpn = (value << 7) | (s.nrpn & 0x7f);
+			return false;
+		case 98:
+			s.nrpn = (s.nrpn & 0x3f80) | value;
+			return false;
+		case 101:
+		case 100:
+			// an RPN is being selected
+			s.nrpn = kMidiLearnNoNrpn;
+			return false;
+	}
+	if((6 == controller || 38 == controller) && kMidiLearnNoNrpn != s.nrpn)
+	{
+		// a new MSB resets the LSB, which may follow
+		if(6 == controller)
+		{
+			s.dataMsb = value;
+			s.dataLsb = 0;
+		} else
+			s.dataLsb = value;
+		if(gMidiLearnArmed >= 0)
+			midiLearnBind(kMidiLearnNrpn, channel, s.nrpn);
+		int idx = midiLearnFind(kMidiLearnNrpn, channel, s.nrpn);
+		if(idx < 0)
+			return false;
+		midiLearnApply(idx, ((s.dataMsb << 7) | s.dataLsb) / 16383.f);
+		return true;
+	}
+	if(controller < 32)
+	{
+		// a new MSB resets the LSB, which may follow
+		s.msb[controller] = value;
+		s.lsb[controller] = 0;
+		int idx = midiLearnFind(kMidiLearnCc14, channel, controller);
+		if(idx >= 0)
+		{
+			midiLearnApply(idx, ((value << 7) | s.lsb[controller]) / 16383.f);
+			return true;
 		}
-		int channel = libpd_get_float(&argv[0]) - gLibpdDigitalChannelOffset;
-		if(disable == true){
-			dcm.unmanage(channel);
-			return;
+	} else if(controller < 64) {
+		unsigned int msb = controller - 32;
+		s.lsb[msb] = value;
+		int idx = midiLearnFind(kMidiLearnCc, channel, msb);
+		if(idx >= 0 && idx == gMidiLearnLast)
+		{
+			// the controller we just learned also sends an LSB
+			gMidiLearnMappings[idx].type = kMidiLearnCc14;
+			rt_printf("MIDI learn: cc %u on port %u channel %u is 14-bit\n", msb, channel / 16, channel % 16);
+			midiLearnSave();
 		}
-		if(argc >= 2){
-			t_atom* a = &argv[1];
-			if(libpd_is_symbol(a)){
-				const char *s = libpd_get_symbol(a);
-				if(strcmp(s, "~") == 0  || strncmp(s, "sig", 3) == 0){
-					isMessageRate = false;
-				}
-			}
+		idx = midiLearnFind(kMidiLearnCc14, channel, msb);
+		if(idx >= 0)
+		{
+			midiLearnApply(idx, ((s.msb[msb] << 7) | value) / 16383.f);
+			return true;
 		}
-		dcm.manage(channel, direction, isMessageRate);
+	}
+	if(gMidiLearnArmed >= 0)
+		midiLearnBind(kMidiLearnCc, channel, controller);
+	int idx = midiLearnFind(kMidiLearnCc, channel, controller);
+	if(idx < 0)
+		return false;
+	midiLearnApply(idx, value / 127.f);
+	return true;
+}
+
+static void midiLearnMessage(const char* symbol, int argc, t_atom* argv)
+{
+	if(0 == strcmp(symbol, "clear"))
+	{
+		gMidiLearnNumMappings = 0;
+		gMidiLearnLast = -1;
+		midiLearnSave();
 		return;
 	}
-	if(strcmp(source, "bela_control") == 0){
-		if(strcmp("stop", symbol) == 0){
-			rt_printf("bela_control: stop\n");
-			Bela_requestStop();
-		}
+	if(0 == strcmp(symbol, "cancel"))
+	{
+		gMidiLearnArmed = -1;
 		return;
 	}
-#ifdef BELA_LIBPD_GUI
-	if(0 == strcmp(source, "bela_setGui"))
+	int param = -1;
+	if(1 == argc && libpd_is_symbol(argv))
+		param = midiLearnFindParam(libpd_get_symbol(argv));
+	if(param < 0 || (strcmp(symbol, "learn") && strcmp(symbol, "forget")))
 	{
-		if(0 == strcmp(symbol, "new"))
-		{
-			if(
-				argc < 2
-				|| !libpd_is_symbol(argv)
-				|| !libpd_is_symbol(argv + 1)
-			)
-			{
-				return;
-			}
-			const char* mode = libpd_get_symbol(argv);
-			const char* name = libpd_get_symbol(argv + 1);
-			if(0 == strcmp(mode, "control"))
-			{
-				gGuiControlBuffers.emplace_back(name);
-				return;
-			}
-			if(0 == strcmp(mode, "array"))
-			{
-				// because of
-				// https://github.com/libpd/libpd/issues/274
-				// (again), we cannot access the arrays right
-				// here (as it would deadlock on loadbang), so
-				// we have to defer creation of the Gui
-				// buffers until render() runs
-				gGuiDataBuffers.emplace_back(bufferDescription{.name = name, .id = -1, .size = 0});
-				return;
-			}
-			return;
-		}
+		rt_fprintf(stderr, "Wrong format for bela_midiLearn, expected: [learn <param>(, [forget <param>(, [clear( or [cancel(\n");
+		return;
 	}
-#endif // BELA_LIBPD_GUI
-#ifdef BELA_LIBPD_SERIAL
-	if(0 == strcmp(source, "bela_setSerial"))
-	{
-		if(0 == strcmp(symbol, "new"))
-		{
-			if(
-				argc < 5
-				|| !libpd_is_symbol(argv + 0)
-				|| !libpd_is_symbol(argv + 1)
-				|| !libpd_is_float(argv + 2)
-				|| !libpd_is_symbol(argv + 3)
-				|| !libpd_is_symbol(argv + 4)
-			)
-			{
-				fprintf(stderr, "Invalid bela_setSerial arguments. Should be: `new serial_id device baudrate EOM type`, where `EOM` is one of `newline` or `none` and `type` is one of `floats`, `symbol`, `symbols`\n");
-				return;
-			}
-			gSerialId = libpd_get_symbol(argv + 0);
-			const char* device = libpd_get_symbol(argv + 1);
-			unsigned int baudrate = libpd_get_float(argv + 2);
-			const char* eom = libpd_get_symbol(argv + 3);
-			if(0 == strcmp(eom, "newline"))
-				gSerialEom = '\n';
-			else
-				gSerialEom = -1;
-			const char* type = libpd_get_symbol(argv + 4);
-			if(0 == strcmp("floats", type))
-				gSerialType = kSerialFloats;
-			else if(0 == strcmp("symbol", type))
-				gSerialType = kSerialSymbol;
-			else if(0 == strcmp("symbols", type))
-				gSerialType = kSerialSymbols;
-
-			if(gSerial.setup(device, baudrate))
-				return;
-			gSerialInputTask = Bela_runAuxiliaryTask(serialInputLoop, 0);
-			gSerialOutputTask = Bela_runAuxiliaryTask(serialOutputLoop, 0);
-		}
+	if(0 == strcmp(symbol, "learn"))
+	{
+		gMidiLearnArmed = param;
+		gMidiLearnLast = -1;
+		return;
 	}
-#endif // BELA_LIBPD_SERIAL
-#ifdef BELA_LIBPD_TRILL
-	if(0 == strcmp(source, "bela_setTrill"))
+	for(unsigned int n = gMidiLearnNumMappings; n > 0; --n)
+		if(gMidiLearnMappings[n - 1].param == param)
+			midiLearnRemove(n - 1);
+	midiLearnSave();
+}
+
+static void midiDispatchMessage(unsigned int port, MidiChannelMessage& message, double frame)
+{
+	if(gMidiVerbose >= kMidiVerbosePrintLevel)
 	{
-		if(0 == strcmp(symbol, "new"))
+		rt_printf("On port %d (%s): ", port, gMidiPortNames[port].c_str());
+		message.prettyPrint(); // use this to print beautified message (channel, data bytes)
+	}
+	switch(message.getType()){
+		case kmmNoteOn:
 		{
-			bool err = false;
-
-			uint8_t address = 0xff;
-			if(argc < 3)
-				err = true;
-			else if (!libpd_is_symbol(argv) // sensor_id
-				|| !libpd_is_float(argv + 1) // bus
-				|| !libpd_is_symbol(argv + 2) // device
-			)
-				err = true;
-			if(argc >= 4)
-			{
-				if(libpd_is_float(argv + 3))
-					address = libpd_get_float(argv + 3);
-				else
-					err = true;
-			}
-			if(err)
-			{
-				rt_fprintf(stderr, "bela_setTrill wrong format. Should be:\n"
-					"[new <sensor_id> <bus> <device> <address>(\n");
-				return;
-			}
-			const char* name = libpd_get_symbol(argv);
-			unsigned int bus = libpd_get_float(argv + 1);
-			const char* deviceString = libpd_get_symbol(argv + 2);
-			Trill::Device device = Trill::getDeviceFromName(deviceString);
+			int noteNumber = message.getDataByte(0);
+			int velocity = message.getDataByte(1);
+			int channel = message.getChannel();
+			libpd_noteon(channel + port * 16, noteNumber, velocity);
+			break;
+		}
+		case kmmNoteOff:
+		{
+			/* PureData does not seem to handle noteoff messages as per the MIDI specs,
+			 * so that the noteoff velocity is ignored. Here we convert them to noteon
+			 * with a velocity of 0.
+			 */
+			int noteNumber = message.getDataByte(0);
+	//				int velocity = message.getDataByte(1); // would be ignored by Pd
+			int channel = message.getChannel();
+			libpd_noteon(channel + port * 16, noteNumber, 0);
+			break;
+		}
+		case kmmControlChange:
+		{
+			int channel = message.getChannel();
+			int controller = message.getDataByte(0);
+			int value = message.getDataByte(1);
+			if(midiLearnControlChange(channel + port * 16, controller, value))
+				break;
+			libpd_controlchange(channel + port * 16, controller, value);
+			break;
+		}
+		case kmmProgramChange:
+		{
+			int channel = message.getChannel();
+			int program = message.getDataByte(0);
+			libpd_programchange(channel + port * 16, program);
+			break;
+		}
+		case kmmPolyphonicKeyPressure:
+		{
+			int channel = message.getChannel();
+			int pitch = message.getDataByte(0);
+			int value = message.getDataByte(1);
+			libpd_polyaftertouch(channel + port * 16, pitch, value);
+			break;
+		}
+		case kmmChannelPressure:
+		{
+			int channel = message.getChannel();
+			int value = message.getDataByte(0);
+			libpd_aftertouch(channel + port * 16, value);
+			break;
+		}
+		case kmmPitchBend:
+		{
+			int channel = message.getChannel();
+			int value =  ((message.getDataByte(1) << 7)| message.getDataByte(0)) - 8192;
+			libpd_pitchbend(channel + port * 16, value);
+			break;
+		}
+		case kmmSystem:
+		// currently Bela only handles sysrealtime, and it does so pretending it is a channel message with no data bytes, so we have to re-assemble the status byte
+		{
+			int channel = message.getChannel();
+			int status = message.getStatusByte();
+			int byte = channel | status;
+			libpd_sysrealtime(port, byte);
+			midiClockEvent(byte, frame);
+			break;
+		}
+		case kmmNone:
+		case kmmAny:
+			break;
+	}
+}
+
+// dispatch the events received before the current callback started that
+// belong before frame endFrame of the block, which starts at blockStart
+static void midiDispatch(unsigned int frames, unsigned int endFrame, uint64_t blockStart, unsigned int& budget)
+{
+	uint64_t period = gMidiBlockTime - gMidiPrevBlockTime;
+	unsigned int numPorts = std::min(midi.size(), size_t(kMidiMaxPorts));
+	while(budget)
+	{
+		// oldest event across all ports
+		int port = -1;
+		for(unsigned int n = 0; n < numPorts; ++n)
+		{
+			const MidiEvent* e = gMidiQueues[n].front();
+			if(e && e->time < gMidiBlockTime && (port < 0 || e->time < gMidiQueues[port].front()->time))
+				port = n;
+		}
+		if(port < 0)
+			return;
+		MidiEvent& e = *gMidiQueues[port].front();
+		unsigned int frame = 0;
+		if(e.time > gMidiPrevBlockTime && period && gMidiPrevBlockTime)
+			frame = (e.time - gMidiPrevBlockTime) * frames / period;
+		if(frame >= endFrame)
+			return;
+		midiDispatchMessage(port, e.message, double(blockStart + frame));
+		gMidiQueues[port].pop();
+		--budget;
+	}
+}
+#endif // BELA_LIBPD_MIDI
+
+// [saturate~ <curve> <bias> <oversample>] runs the kernels from
+// Saturation.h in the patch. <curve> is pade (the default, the same curve as
+// [hv.tanh]), tanh, softclip or tape. <oversample> is 1 (the default), 2 or
+// 4. [curve <name>(, [bias <value>( and [oversample <factor>( change them.
+static t_class* gSaturateClass;
+typedef struct {
+	t_object x_obj;
+	t_float x_f;
+	SaturationCurve curve;
+	float bias;
+	Oversampler oversampler;
+} t_saturate;
+
+static t_int* saturatePerform(t_int* w)
+{
+	t_saturate* x = (t_saturate*)w[1];
+	t_sample* in = (t_sample*)w[2];
+	t_sample* out = (t_sample*)w[3];
+	int n = (int)w[4];
+	x->oversampler.process(in, out, n, [x](float* buffer, unsigned int size) {
+		saturateBlock(x->curve, buffer, buffer, size, x->bias);
+	});
+	return w + 5;
+}
+
+static void saturateDsp(t_saturate* x, t_signal** sp)
+{
+	dsp_add(saturatePerform, 4, x, sp[0]->s_vec, sp[1]->s_vec, (t_int)sp[0]->s_n);
+}
+
+static void saturateCurve(t_saturate* x, t_symbol* s)
+{
+	for(unsigned int n = 0; n < kSaturationNumCurves; ++n)
+	{
+		if(0 == strcmp(s->s_name, gSaturationCurveNames[n]))
+		{
+			x->curve = (SaturationCurve)n;
+			return;
+		}
+	}
+	pd_error(x, "saturate~: unknown curve %s", s->s_name);
+}
+
+static void saturateBias(t_saturate* x, t_floatarg f)
+{
+	x->bias = f;
+}
+
+static void saturateOversample(t_saturate* x, t_floatarg f)
+{
+	x->oversampler.setFactor(std::max(1.f, f));
+}
+
+static void* saturateNew(t_symbol* s, t_floatarg bias, t_floatarg oversample)
+{
+	t_saturate* x = (t_saturate*)pd_new(gSaturateClass);
+	x->x_f = 0;
+	x->curve = kSaturationPade;
+	if(*s->s_name)
+		saturateCurve(x, s);
+	x->bias = bias;
+	x->oversampler.setup();
+	x->oversampler.setFactor(std::max(1.f, oversample));
+	outlet_new(&x->x_obj, &s_signal);
+	return x;
+}
+
+// call after libpd_init() and before opening the patch
+static void saturateSetup()
+{
+	gSaturateClass = class_new(gensym("saturate~"), (t_newmethod)(void(*)(void))saturateNew, 0,
+		sizeof(t_saturate), CLASS_DEFAULT, A_DEFSYM, A_DEFFLOAT, A_DEFFLOAT, 0);
+	CLASS_MAINSIGNALIN(gSaturateClass, t_saturate, x_f);
+	class_addmethod(gSaturateClass, (t_method)saturateDsp, gensym("dsp"), A_CANT, 0);
+	class_addmethod(gSaturateClass, (t_method)saturateCurve, gensym("curve"), A_SYMBOL, 0);
+	class_addmethod(gSaturateClass, (t_method)saturateBias, gensym("bias"), A_FLOAT, 0);
+	class_addmethod(gSaturateClass, (t_method)saturateOversample, gensym("oversample"), A_FLOAT, 0);
+}
+
+// [xfade~] replaces cos_xfade.pd: dry and wet signal inlets, the dry/wet
+// control (0 to 1) on the right inlet. See Crossfade.h.
+static t_class* gXfadeClass;
+typedef struct {
+	t_object x_obj;
+	t_float x_f;
+	Crossfade crossfade;
+} t_xfade;
+
+static t_int* xfadePerform(t_int* w)
+{
+	t_xfade* x = (t_xfade*)w[1];
+	t_sample* dry = (t_sample*)w[2];
+	t_sample* wet = (t_sample*)w[3];
+	t_sample* out = (t_sample*)w[4];
+	int n = (int)w[5];
+	x->crossfade.process(dry, wet, out, n);
+	return w + 6;
+}
+
+static void xfadeDsp(t_xfade* x, t_signal** sp)
+{
+	x->crossfade.setSampleRate(sp[0]->s_sr);
+	dsp_add(xfadePerform, 5, x, sp[0]->s_vec, sp[1]->s_vec, sp[2]->s_vec, (t_int)sp[0]->s_n);
+}
+
+static void xfadeMix(t_xfade* x, t_floatarg f)
+{
+	x->crossfade.setTarget(f);
+}
+
+static void* xfadeNew()
+{
+	t_xfade* x = (t_xfade*)pd_new(gXfadeClass);
+	x->x_f = 0;
+	x->crossfade.setup();
+	inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_signal, &s_signal);
+	inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_float, gensym("mix"));
+	outlet_new(&x->x_obj, &s_signal);
+	return x;
+}
+
+// call after libpd_init() and before opening the patch
+static void xfadeSetup()
+{
+	crossfadeSetupTable();
+	gXfadeClass = class_new(gensym("xfade~"), (t_newmethod)xfadeNew, 0,
+		sizeof(t_xfade), CLASS_DEFAULT, 0);
+	CLASS_MAINSIGNALIN(gXfadeClass, t_xfade, x_f);
+	class_addmethod(gXfadeClass, (t_method)xfadeDsp, gensym("dsp"), A_CANT, 0);
+	class_addmethod(gXfadeClass, (t_method)xfadeMix, gensym("mix"), A_FLOAT, 0);
+}
+
+void Bela_printHook(const char *received){
+	rt_printf("%s", received);
+}
+
+static DigitalChannelManager dcm;
+
+void sendDigitalMessage(bool state, unsigned int delay, void* receiverName){
+	libpd_float((const char*)receiverName, (float)state);
+//	rt_printf("%s: %d\n", (char*)receiverName, state);
+}
+
+#ifdef BELA_LIBPD_TRILL
+void setTrillPrintError()
+{
+	rt_fprintf(stderr, "bela_setTrill format is wrong. Should be:\n"
+		"[mode <sensor_id> <prescaler_value>(\n"
+		" or\n"
+		"[threshold <sensor_id> <threshold_value>(\n"
+		" or\n"
+		"[prescaler <sensor_id> <prescaler_value>(\n");
+}
+#endif // BELA_LIBPD_TRILL
+
+void Bela_listHook(const char *source, int argc, t_atom *argv)
+{
+	if(hookHeld(DeferredHook::kList, source, nullptr, 0, argc, argv))
+		return;
+	const HookEntry& hook = findHook(source);
+#ifdef BELA_LIBPD_PIPELINE
+	if(kHookPipelineForward == hook.receiver)
+	{
+		pipelineForward(source, "list", argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_PIPELINE
+#ifdef BELA_LIBPD_SERIAL
+	if(kHookSerialOut == hook.receiver)
+	{
+		serialOutEnqueue(nullptr, argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_SERIAL
+#ifdef BELA_LIBPD_GUI
+	if(kHookGuiTelemetry == hook.receiver)
+	{
+		if(subsystemStarted(kSubsystemGui))
+			guiTelemetryReceive(argc, argv);
+		return;
+	}
+	if(kHookGuiOut == hook.receiver)
+	{
+		if(!subsystemStarted(kSubsystemGui))
+			return;
+		if(!libpd_is_float(&argv[0]))
+		{
+			rt_fprintf(stderr, "Wrong format for bela_gui, the first element should be a float\n");
+			return;
+		}
+		unsigned int bufNum = libpd_get_float(&argv[0]);
+		if(libpd_is_float(&argv[1])) // if the first element is a float, we send an array of floats
+		{
+			float* buf = gRtScratch.get<float>(kRtScratchList, argc - 1);
+			if(!buf)
+			{
+				rt_fprintf(stderr, "bela_gui: list too long (%d elements)\n", argc - 1);
+				return;
+			}
+			for(int n = 1; n < argc; ++n)
+			{
+				t_atom *a = &argv[n];
+				if(!libpd_is_float(a))
+				{
+					rt_fprintf(stderr, "Wrong format for bela_gui\n"); // this should never happen, because then the selector would've not been "float"
+					return;
+				}
+				buf[n - 1] = libpd_get_float(a);
+			}
+			gui.sendBuffer(bufNum, buf, argc - 1);
+			return;
+		} else { // otherwise we send each element of the list separately
+			for(int n = 1; n < argc; ++n)
+			{
+				t_atom *a = &argv[n];
+				if (libpd_is_float(a)) {
+					float x = libpd_get_float(a);
+					gui.sendBuffer(bufNum, x);
+				} else if (libpd_is_symbol(a)) {
+					const char *s = libpd_get_symbol(a);
+					gui.sendBuffer(bufNum, s, strlen(s)); // TODO: should it be strlen(s)+1?
+				}
+			}
+		}
+		return;
+	}
+#endif // BELA_LIBPD_GUI
+}
+static char multiplexerArray[] = {"bela_multiplexer"};
+static int multiplexerArraySize = 0;
+static bool pdMultiplexerActive = false;
+static int gMultiplexerChannels = 0;
+// Last values written to the multiplexer array. Only the ranges of channels
+// that moved by more than gMultiplexerThreshold are written again.
+static std::vector<float> gMultiplexerWritten;
+static float gMultiplexerThreshold = 0.001;
+// When gMultiplexerSmoothing is not 0, each channel is also lowpassed and
+// sent to [r bela_multiplexerControl] as [<channel> <value>( when it changes
+static std::vector<float> gMultiplexerFiltered;
+static std::vector<float> gMultiplexerSent;
+static float gMultiplexerSmoothing = 0;
+// ranges closer than this are merged into a single write
+static constexpr int kMultiplexerMaxGap = 4;
+
+// If the user wants to use the multiplexer capelet,
+// the patch will have to contain an array called "bela_multiplexer"
+// and a receiver [r bela_multiplexerChannels]
+static void multiplexerPatchLoaded()
+{
+	pdMultiplexerActive = gMultiplexerChannels > 0 && libpd_arraysize(multiplexerArray) >= 0;
+	if(!pdMultiplexerActive)
+		return;
+	// [; bela_multiplexer ` multiplexerArraySize` resize(
+	libpd_start_message(1);
+	libpd_add_float(multiplexerArraySize);
+	libpd_finish_message(multiplexerArray, "resize");
+	// [; bela_multiplexerChannels `gMultiplexerChannels`(
+	libpd_float("bela_multiplexerChannels", gMultiplexerChannels);
+	// NaN so that the first update writes the whole array
+	gMultiplexerWritten.assign(multiplexerArraySize, NAN);
+	gMultiplexerFiltered.assign(multiplexerArraySize, 0);
+	gMultiplexerSent.assign(multiplexerArraySize, NAN);
+}
+
+// writes channels start to last, including the unchanged ones in between
+static void multiplexerWrite(const float* in, int start, int last)
+{
+	libpd_write_array(multiplexerArray, start, const_cast<float*>(in) + start, last - start + 1);
+	std::copy(in + start, in + last + 1, gMultiplexerWritten.begin() + start);
+}
+
+static void multiplexerUpdate(const float* in)
+{
+	int start = -1;
+	int last = -1;
+	for(int n = 0; n < multiplexerArraySize; ++n)
+	{
+		if(fabsf(in[n] - gMultiplexerWritten[n]) <= gMultiplexerThreshold)
+			continue;
+		if(start >= 0 && n - last > kMultiplexerMaxGap)
+		{
+			multiplexerWrite(in, start, last);
+			start = -1;
+		}
+		if(start < 0)
+			start = n;
+		last = n;
+	}
+	if(start >= 0)
+		multiplexerWrite(in, start, last);
+
+	if(!gMultiplexerSmoothing)
+		return;
+	for(int n = 0; n < multiplexerArraySize; ++n)
+	{
+		gMultiplexerFiltered[n] += gMultiplexerSmoothing * (in[n] - gMultiplexerFiltered[n]);
+		if(fabsf(gMultiplexerFiltered[n] - gMultiplexerSent[n]) <= gMultiplexerThreshold)
+			continue;
+		gMultiplexerSent[n] = gMultiplexerFiltered[n];
+		libpd_start_message(2);
+		libpd_add_float(n);
+		libpd_add_float(gMultiplexerFiltered[n]);
+		libpd_finish_list("bela_multiplexerControl");
+	}
+}
+
+// Another patch can be loaded with [; bela_loadPatch <file>( while running.
+// gPatchSwapTask opens the new patch and runs a few blocks of silence
+// through it, so that the allocations and page faults of its first blocks
+// happen there, while the hooks it fires are queued. It then creates what
+// the queued hooks ask for (Trill sensors, MIDI ports, the serial port, Gui
+// controls and buffers) apart from the state of the running patch.
+// render() swaps that in for the old patch's, runs the other queued hooks
+// and fades the new patch in.
+// With BELA_LIBPD_SWAP_INSTANCES the new patch is opened in its own
+// instance while the old one keeps running, and the two are crossfaded.
+// Otherwise the output fades out and render() stops calling into Pd while
+// the new patch is opened and the old one is closed.
+// Then gPatchSwapTask releases what the old patch used.
+enum PatchSwapState {
+	kPatchSwapIdle,
+	kPatchSwapFadeOut,
+	kPatchSwapLoading,
+	kPatchSwapReady, // for render() to hand over to the new patch
+	kPatchSwapFadeIn,
+	kPatchSwapClosing,
+};
+static std::atomic<int> gPatchSwapState(kPatchSwapIdle);
+static char gPatchSwapFile[256];
+static float gPatchSwapGain = 1;
+static AuxiliaryTask gPatchSwapTask;
+static constexpr float kPatchSwapFadeMs = 20;
+static constexpr unsigned int kPatchSwapWarmupBlocks = 32;
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+// the instance render() runs
+static std::atomic<t_pdinstance*> gPdInstance;
+static float gPatchSwapSampleRate;
+// the new patch until the handoff, then the old one
+static t_pdinstance* gPatchSwapInstance;
+static void* gPatchSwapPatch;
+static float* gPatchSwapInBuf;
+static float* gPatchSwapOutBuf;
+static HookTable gPatchSwapHooks;
+#endif // BELA_LIBPD_SWAP_INSTANCES
+#ifdef BELA_LIBPD_MIDI
+// ports opened for the new patch, added to midi by render() at the handoff
+static std::vector<std::pair<std::string,Midi*>> gPatchSwapMidi;
+#endif // BELA_LIBPD_MIDI
+
+static void patchSwapRequest(const char* file)
+{
+	if(kPatchSwapIdle != gPatchSwapState)
+	{
+		rt_fprintf(stderr, "bela_loadPatch: still loading %s, ignoring %s\n", gPatchSwapFile, file);
+		return;
+	}
+	if(strlen(file) >= sizeof(gPatchSwapFile))
+	{
+		rt_fprintf(stderr, "bela_loadPatch: file name too long\n");
+		return;
+	}
+	strcpy(gPatchSwapFile, file);
+#ifdef BELA_LIBPD_GUI
+	guiListRunningBuffers();
+#endif // BELA_LIBPD_GUI
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	gPatchSwapState = kPatchSwapLoading;
+	Bela_scheduleAuxiliaryTask(gPatchSwapTask);
+#else // BELA_LIBPD_SWAP_INSTANCES
+	gPatchSwapState = kPatchSwapFadeOut;
+#endif // BELA_LIBPD_SWAP_INSTANCES
+}
+
+#ifdef BELA_LIBPD_GUI
+// [; bela_setGui new <control|array> <name>(, for the controls and arrays of
+// state
+static void guiMessage(GuiState& state, const char* symbol, int argc, t_atom* argv)
+{
+	if(0 == strcmp(symbol, "new"))
+	{
+		if(
+			argc < 2
+			|| !libpd_is_symbol(argv)
+			|| !libpd_is_symbol(argv + 1)
+		)
+		{
+			return;
+		}
+		const char* mode = libpd_get_symbol(argv);
+		const char* name = libpd_get_symbol(argv + 1);
+		if(0 == strcmp(mode, "control"))
+		{
+			// the Gui thread learns about it in guiControlsCommit()
+			state.controlBuffers.emplace_back(name);
+			return;
+		}
+		if(0 == strcmp(mode, "array"))
+		{
+			// because of
+			// https://github.com/libpd/libpd/issues/274
+			// (again), we cannot access the arrays right
+			// here (as it would deadlock on loadbang), so
+			// we have to defer creation of the Gui
+			// buffers until render() runs
+			state.dataBuffers.emplace_back(bufferDescription{.name = name, .id = -1, .size = 0, .array = nullptr});
+			return;
+		}
+		return;
+	}
+}
+#endif // BELA_LIBPD_GUI
+
+#ifdef BELA_LIBPD_SERIAL
+// [; bela_setSerial new ...(
+static void serialMessage(const char* symbol, int argc, t_atom* argv)
+{
+	if(0 == strcmp(symbol, "new"))
+	{
+		if(
+			argc < 5
+			|| !libpd_is_symbol(argv + 0)
+			|| !libpd_is_symbol(argv + 1)
+			|| !libpd_is_float(argv + 2)
+			|| !libpd_is_symbol(argv + 3)
+			|| !libpd_is_symbol(argv + 4)
+		)
+		{
+			fprintf(stderr, "Invalid bela_setSerial arguments. Should be: `new serial_id device baudrate EOM type`, where `EOM` is one of `newline` or `none` and `type` is one of `floats`, `symbol`, `symbols`\n");
+			return;
+		}
+		gSerialId = libpd_get_symbol(argv + 0);
+		const char* device = libpd_get_symbol(argv + 1);
+		unsigned int baudrate = libpd_get_float(argv + 2);
+		const char* eom = libpd_get_symbol(argv + 3);
+		if(0 == strcmp(eom, "newline"))
+			gSerialEom = '\n';
+		else
+			gSerialEom = -1;
+		const char* type = libpd_get_symbol(argv + 4);
+		if(0 == strcmp("floats", type))
+			gSerialType = kSerialFloats;
+		else if(0 == strcmp("symbol", type))
+			gSerialType = kSerialSymbol;
+		else if(0 == strcmp("symbols", type))
+			gSerialType = kSerialSymbols;
+
+		if(gSerial.setup(device, baudrate))
+			return;
+		gSerialInputTask = Bela_runAuxiliaryTask(serialInputLoop, 0);
+		gSerialOutputTask = Bela_runAuxiliaryTask(serialOutputLoop, 0);
+	}
+}
+#endif // BELA_LIBPD_SERIAL
+
+#ifdef BELA_LIBPD_TRILL
+// [; bela_setTrill ...(, for the sensors of trill
+static void trillMessage(TrillState& trill, const char* symbol, int argc, t_atom* argv)
+{
+	if(0 == strcmp(symbol, "new"))
+	{
+		bool err = false;
+
+		uint8_t address = 0xff;
+		if(argc < 3)
+			err = true;
+		else if (!libpd_is_symbol(argv) // sensor_id
+			|| !libpd_is_float(argv + 1) // bus
+			|| !libpd_is_symbol(argv + 2) // device
+		)
+			err = true;
+		if(argc >= 4)
+		{
+			if(libpd_is_float(argv + 3))
+				address = libpd_get_float(argv + 3);
+			else
+				err = true;
+		}
+		if(err)
+		{
+			rt_fprintf(stderr, "bela_setTrill wrong format. Should be:\n"
+				"[new <sensor_id> <bus> <device> <address>(\n");
+			return;
+		}
+		const char* name = libpd_get_symbol(argv);
+		unsigned int bus = libpd_get_float(argv + 1);
+		const char* deviceString = libpd_get_symbol(argv + 2);
+		Trill::Device device = Trill::getDeviceFromName(deviceString);
+
+		Trill* sensor = new Trill(bus, device, address);
+		if(Trill::NONE == sensor->deviceType())
+		{
+			rt_fprintf(stderr, "Unable to create Trill %s device `%s` on bus %u at ", deviceString, name, bus);
+			if(128 < address)
+				rt_fprintf(stderr, "default address. ");
+			else
+				rt_fprintf(stderr, "address: %#x (%d). ", address, address);
+			rt_fprintf(stderr, "Is the device connected?\n");
+			return;
+		}
+		trill.sensors.emplace_back(std::string(name), sensor);
+		trill.arrayNames.push_back(std::string("bela_trill_") + name);
+		trill.arraySizes.push_back(-1);
+		trill.acks.push_back(name);
+		//an ack is sent to Pd during the next audio callback because of https://github.com/libpd/libpd/issues/274
+		return;
+	}
+	if(argc < 1 || !libpd_is_symbol(argv))
+	{
+		rt_fprintf(stderr, "bela_setTrill: wrong format. It should be\n"
+				"[<command> <sensor_id> ...(");
+		return;
+	}
+	const char* sensorId = libpd_get_symbol(argv);
+	int idx = getIdxFromId(sensorId, trill.sensors);
+	if(idx < 0)
+	{
+		rt_fprintf(stderr, "bela_setTrill sensor_id unknown: %s\n", sensorId);
+		return;
+	}
+	if(0 == strcmp(symbol, "updateBaseline"))
+	{
+		trill.sensors[idx].second->updateBaseline();
+		return;
+	}
+	if(0 == strcmp(symbol, "mode"))
+	{
+		if(argc < 2
+			|| !libpd_is_symbol(argv)
+			|| !libpd_is_symbol(argv + 1)
+		) {
+			setTrillPrintError();
+			return;
+		}
+		const char* modeString = libpd_get_symbol(argv + 1);
+		Trill::Mode mode = Trill::getModeFromName(modeString);
+		trill.sensors[idx].second->setMode(mode);
+	}
+	if(
+		0 == strcmp(symbol, "threshold")
+		|| 0 == strcmp(symbol, "prescaler")
+	)
+	{
+		if(
+			argc < 2
+			|| !libpd_is_symbol(argv)
+			|| !libpd_is_float(argv + 1)
+		  ) {
+			setTrillPrintError();
+			return;
+		}
+		float value = libpd_get_float(argv + 1);
+		if(0 == strcmp(symbol, "threshold"))
+		{
+			trill.sensors[idx].second->setNoiseThreshold(value);
+		}
+		if(0 == strcmp(symbol, "prescaler"))
+		{
+			if(Trill::prescalerMax < value || 0 > value)
+			{
+				if(0 == value)
+					value = 0;
+				if(Trill::prescalerMax < value)
+					value = Trill::prescalerMax;
+				rt_printf("bela_setTrill prescaler value out of range, clipping to %u\n", value);
+			}
+			trill.sensors[idx].second->setPrescaler(value);
+		}
+		return;
+	}
+}
+#endif // BELA_LIBPD_TRILL
+
+void Bela_messageHook(const char *source, const char *symbol, int argc, t_atom *argv){
+	if(hookHeld(DeferredHook::kMessage, source, symbol, 0, argc, argv))
+		return;
+	const HookEntry& hook = findHook(source);
+#ifdef BELA_LIBPD_PIPELINE
+	if(kHookPipelineForward == hook.receiver)
+	{
+		pipelineForward(source, symbol, argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_PIPELINE
+#ifdef BELA_LIBPD_SERIAL
+	if(kHookSerialOut == hook.receiver)
+	{
+		serialOutEnqueue(symbol, argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_SERIAL
+	if(kHookLoadPatch == hook.receiver)
+	{
+		// [; bela_loadPatch song2.pd(
+		patchSwapRequest(symbol);
+		return;
+	}
+#ifdef BELA_LIBPD_MIDI
+	if(kHookMidiLearn == hook.receiver)
+	{
+		midiLearnMessage(symbol, argc, argv);
+		return;
+	}
+	if(kHookSetMidi == hook.receiver)
+	{
+		if(0 == strcmp("verbose", symbol))
+		{
+			if(1 != argc || !libpd_is_float(argv))
+			{
+				rt_fprintf(stderr, "Wrong format for bela_setMidi, expected: [verbose <n>(\n");
+			} else {
+				gMidiVerbose = libpd_get_float(argv);
+				rt_printf("MIDI verbose: %d\n", gMidiVerbose);
+			}
+			return;
+		}
+		std::string deviceName;
+		if(!midiDeviceName(symbol, argc, argv, deviceName))
+			return;
+		printf("Adding Midi device: %s\n", deviceName.c_str());
+		Midi* newMidi = openMidiDevice(deviceName, false, true);
+		if(newMidi)
+		{
+			midi.push_back(newMidi);
+			gMidiPortNames.push_back(deviceName);
+			midiListen(midi.size() - 1);
+		}
+		dumpMidi();
+		return;
+	}
+#endif // BELA_LIBPD_MIDI
+	if(kHookSetDigital == hook.receiver){
+		// symbol is the direction, argv[0] is the channel, argv[1] (optional)
+		// is signal("sig" or "~") or message("message", default) rate
+		bool isMessageRate = true; // defaults to message rate
+		bool direction = 0; // initialize it just to avoid the compiler's warning
+		bool disable = false;
+		if(strcmp(symbol, "in") == 0){
+			direction = INPUT;
+		} else if(strcmp(symbol, "out") == 0){
+			direction = OUTPUT;
+		} else if(strcmp(symbol, "disable") == 0){
+			disable = true;
+		} else {
+			return;
+		}
+		if(argc == 0){
+			return;
+		} else if (libpd_is_float(&argv[0]) == false){
+			return;
+		}
+		int channel = libpd_get_float(&argv[0]) - gLibpdDigitalChannelOffset;
+		if(disable == true){
+			dcm.unmanage(channel);
+			return;
+		}
+		if(argc >= 2){
+			t_atom* a = &argv[1];
+			if(libpd_is_symbol(a)){
+				const char *s = libpd_get_symbol(a);
+				if(strcmp(s, "~") == 0  || strncmp(s, "sig", 3) == 0){
+					isMessageRate = false;
+				}
+			}
+		}
+		dcm.manage(channel, direction, isMessageRate);
+		return;
+	}
+	if(kHookControl == hook.receiver){
+		if(strcmp("stop", symbol) == 0){
+			rt_printf("bela_control: stop\n");
+			Bela_requestStop();
+		}
+		return;
+	}
+#ifdef BELA_LIBPD_GUI
+	if(kHookSetGui == hook.receiver)
+	{
+		guiMessage(gGui, symbol, argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_GUI
+#ifdef BELA_LIBPD_SERIAL
+	if(kHookSetSerial == hook.receiver)
+	{
+		serialMessage(symbol, argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_SERIAL
+	if(kHookSetMultiplexer == hook.receiver)
+	{
+		if(1 == argc && libpd_is_float(argv))
+		{
+			float value = libpd_get_float(argv);
+			if(0 == strcmp(symbol, "threshold"))
+			{
+				gMultiplexerThreshold = std::max(0.f, value);
+				return;
+			}
+			if(0 == strcmp(symbol, "smooth"))
+			{
+				// 0 disables bela_multiplexerControl, 1 sends unfiltered values
+				gMultiplexerSmoothing = std::min(std::max(value, 0.f), 1.f);
+				return;
+			}
+		}
+		rt_fprintf(stderr, "Wrong format for bela_setMultiplexer, expected: [threshold <value>( or [smooth <coefficient>(\n");
+		return;
+	}
+#ifdef BELA_LIBPD_SCOPE
+	if(kHookSetScope == hook.receiver)
+	{
+		if(0 == strcmp(symbol, "decimate") && 1 == argc && libpd_is_float(argv))
+		{
+			gScopeDecimation = std::max(1.f, libpd_get_float(argv));
+			return;
+		}
+		if(0 == strcmp(symbol, "trigger") && 1 == argc)
+		{
+			if(libpd_is_float(argv))
+			{
+				gScopeTriggerLevel = libpd_get_float(argv);
+				gScopeTriggerEnabled = true;
+				return;
+			}
+			if(libpd_is_symbol(argv) && 0 == strcmp(libpd_get_symbol(argv), "off"))
+			{
+				gScopeTriggerEnabled = false;
+				return;
+			}
+		}
+		rt_fprintf(stderr, "Wrong format for bela_setScope, expected: [decimate <n>(, [trigger <level>( or [trigger off(\n");
+		return;
+	}
+#endif // BELA_LIBPD_SCOPE
+#ifdef BELA_LIBPD_TRILL
+	if(kHookSetTrill == hook.receiver)
+	{
+		trillMessage(gTrill, symbol, argc, argv);
+		return;
+	}
+#endif // BELA_LIBPD_TRILL
+}
+
+void Bela_floatHook(const char *source, float value){
+	if(hookHeld(DeferredHook::kFloat, source, nullptr, value))
+		return;
+	const HookEntry& hook = findHook(source);
+#ifdef BELA_LIBPD_PIPELINE
+	if(kHookPipelineForward == hook.receiver)
+	{
+		t_atom atom;
+		libpd_set_float(&atom, value);
+		pipelineForward(source, "float", 1, &atom);
+		return;
+	}
+#endif // BELA_LIBPD_PIPELINE
+	// the built-in digital receivers "bela_digitalOutXX" are the busiest
+	if(kHookDigitalOut == hook.receiver){
+		if(hook.arg < gDigitalChannelsInUse){ //number of digital channels
+			dcm.setValue(hook.arg, value);
+		}
+		return;
+	}
+#ifdef BELA_LIBPD_SERIAL
+	if(kHookSerialOut == hook.receiver)
+	{
+		t_atom atom;
+		libpd_set_float(&atom, value);
+		serialOutEnqueue(nullptr, 1, &atom);
+		return;
+	}
+#endif // BELA_LIBPD_SERIAL
+#ifdef BELA_LIBPD_MIDI
+	if(kHookMidiClockSync == hook.receiver)
+	{
+		gMidiClockSync = value;
+		gMidiClockTempoSent = -1; // force an update
+		gMidiClockDelaySent = 0;
+		return;
+	}
+#endif // BELA_LIBPD_MIDI
+#ifdef BELA_LIBPD_OLED
+	gOledState.processFloat(hook, value);
+#endif // BELA_LIBPD_OLED
+}
+
+void Bela_symbolHook(const char *source, const char *symbol){
+	if(hookHeld(DeferredHook::kSymbol, source, symbol, 0))
+		return;
+	const HookEntry& hook = findHook(source);
+#ifdef BELA_LIBPD_PIPELINE
+	if(kHookPipelineForward == hook.receiver)
+	{
+		t_atom atom;
+		libpd_set_symbol(&atom, symbol);
+		pipelineForward(source, "symbol", 1, &atom);
+		return;
+	}
+#endif // BELA_LIBPD_PIPELINE
+#ifdef BELA_LIBPD_SERIAL
+	if(kHookSerialOut == hook.receiver)
+		serialOutEnqueue(symbol, 0, nullptr);
+#endif // BELA_LIBPD_SERIAL
+	if(kHookLoadPatch == hook.receiver)
+		patchSwapRequest(symbol);
+}
+
+void Bela_bangHook(const char *source){
+	if(hookHeld(DeferredHook::kBang, source, nullptr, 0))
+		return;
+	const HookEntry& hook = findHook(source);
+#ifdef BELA_LIBPD_PIPELINE
+	if(kHookPipelineForward == hook.receiver)
+	{
+		pipelineForward(source, "bang", 0, nullptr);
+		return;
+	}
+#endif // BELA_LIBPD_PIPELINE
+#ifdef BELA_LIBPD_OLED
+	gOledState.processBang(hook);
+#endif // BELA_LIBPD_OLED
+}
+
+
+
+std::vector<std::string> gReceiverInputNames;
+std::vector<std::string> gReceiverOutputNames;
+void generateDigitalNames(unsigned int numDigitals, unsigned int libpdOffset, std::vector<std::string>& receiverInputNames, std::vector<std::string>& receiverOutputNames)
+{
+	std::string inBaseString = "bela_digitalIn";
+	std::string outBaseString = "bela_digitalOut";
+	for(unsigned int i = 0; i<numDigitals; i++)
+	{
+		receiverInputNames.push_back(inBaseString + std::to_string(i+libpdOffset));
+		receiverOutputNames.push_back(outBaseString + std::to_string(i+libpdOffset));
+	}
+}
+
+void printDigitalNames(std::vector<std::string>& receiverInputNames, std::vector<std::string>& receiverOutputNames)
+{
+	printf("DIGITAL INPUTS\n");
+	for(unsigned int i=0; i<gDigitalChannelsInUse; i++)
+		printf("%s\n", receiverInputNames[i].c_str());
+	printf("DIGITAL OUTPUTS\n");
+	for(unsigned int i=0; i<gDigitalChannelsInUse; i++)
+		printf("%s\n", receiverOutputNames[i].c_str());
+}
+
+#ifdef PD_THREADED_IO
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+static std::atomic<unsigned int> gIoLoops(0);
+#endif // BELA_LIBPD_SWAP_INSTANCES
+void fdLoop(void* arg){
+	while(!Bela_stopRequested()){
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+		// follow render() to the instance of the new patch
+		++gIoLoops;
+		libpd_set_instance(gPdInstance);
+#endif // BELA_LIBPD_SWAP_INSTANCES
+		if(!sys_doio(pd_this))
+			usleep(3000);
+	}
+}
+#endif /* PD_THREADED_IO */
+
+void* gPatch;
+bool gDigitalEnabled = 0;
+
+// the hooks belong to the instance: set them before calling libpd_init(),
+// and in each new instance
+static void libpdSetHooks()
+{
+	libpd_set_printhook(Bela_printHook);
+	libpd_set_floathook(Bela_floatHook);
+	libpd_set_banghook(Bela_bangHook);
+	libpd_set_symbolhook(Bela_symbolHook);
+	libpd_set_listhook(Bela_listHook);
+	libpd_set_messagehook(Bela_messageHook);
+#ifdef BELA_LIBPD_MIDI
+	libpd_set_noteonhook(Bela_MidiOutNoteOn);
+	libpd_set_controlchangehook(Bela_MidiOutControlChange);
+	libpd_set_programchangehook(Bela_MidiOutProgramChange);
+	libpd_set_pitchbendhook(Bela_MidiOutPitchBend);
+	libpd_set_aftertouchhook(Bela_MidiOutAftertouch);
+	libpd_set_polyaftertouchhook(Bela_MidiOutPolyAftertouch);
+	libpd_set_midibytehook(Bela_MidiOutByte);
+#endif // BELA_LIBPD_MIDI
+}
+
+static void patchSwapRunHook(const DeferredHook& h)
+{
+	t_atom* argv = const_cast<t_atom*>(h.argv.data());
+	switch(h.type)
+	{
+	case DeferredHook::kFloat:
+		Bela_floatHook(h.source, h.value);
+		break;
+	case DeferredHook::kBang:
+		Bela_bangHook(h.source);
+		break;
+	case DeferredHook::kSymbol:
+		Bela_symbolHook(h.source, h.symbol);
+		break;
+	case DeferredHook::kList:
+		Bela_listHook(h.source, h.argv.size(), argv);
+		break;
+	case DeferredHook::kMessage:
+		Bela_messageHook(h.source, h.symbol, h.argv.size(), argv);
+		break;
+#ifdef BELA_LIBPD_MIDI
+	case DeferredHook::kNoteOn:
+		Bela_MidiOutNoteOn(h.midi[0], h.midi[1], h.midi[2]);
+		break;
+	case DeferredHook::kControlChange:
+		Bela_MidiOutControlChange(h.midi[0], h.midi[1], h.midi[2]);
+		break;
+	case DeferredHook::kProgramChange:
+		Bela_MidiOutProgramChange(h.midi[0], h.midi[1]);
+		break;
+	case DeferredHook::kPitchBend:
+		Bela_MidiOutPitchBend(h.midi[0], h.midi[1]);
+		break;
+	case DeferredHook::kAftertouch:
+		Bela_MidiOutAftertouch(h.midi[0], h.midi[1]);
+		break;
+	case DeferredHook::kPolyAftertouch:
+		Bela_MidiOutPolyAftertouch(h.midi[0], h.midi[1], h.midi[2]);
+		break;
+	case DeferredHook::kMidiByte:
+		Bela_MidiOutByte(h.midi[0], h.midi[1]);
+		break;
+#endif // BELA_LIBPD_MIDI
+	default:
+		break;
+	}
+}
+
+// runs the part of a queued hook that would block or allocate in render().
+// Returns false if it is left for render()
+static bool patchSwapPrepareHook(const DeferredHook& h)
+{
+	if(DeferredHook::kMessage != h.type)
+		return false;
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	const HookEntry& hook = gPatchSwapHooks.find(h.source);
+#else // BELA_LIBPD_SWAP_INSTANCES
+	const HookEntry& hook = gHooks.find(h.source);
+#endif // BELA_LIBPD_SWAP_INSTANCES
+	unsigned int subsystem = hookSubsystem(hook.receiver);
+	if(subsystem && !(gSubsystemsStarted & subsystem))
+		return false; // render() ignores it
+	t_atom* argv = const_cast<t_atom*>(h.argv.data());
+	int argc = h.argv.size();
+	switch(hook.receiver)
+	{
+#ifdef BELA_LIBPD_TRILL
+	case kHookSetTrill:
+		trillMessage(gTrillNext, h.symbol, argc, argv);
+		return true;
+#endif // BELA_LIBPD_TRILL
+#ifdef BELA_LIBPD_GUI
+	case kHookSetGui:
+		guiMessage(gGuiNext, h.symbol, argc, argv);
+		return true;
+#endif // BELA_LIBPD_GUI
+#ifdef BELA_LIBPD_MIDI
+	case kHookSetMidi:
+	{
+		if(0 == strcmp("verbose", h.symbol))
+			return false;
+		std::string deviceName;
+		if(!midiDeviceName(h.symbol, argc, argv, deviceName))
+			return true;
+		printf("Adding Midi device: %s\n", deviceName.c_str());
+		Midi* newMidi = openMidiDevice(deviceName, false, true);
+		if(newMidi)
+			gPatchSwapMidi.emplace_back(deviceName, newMidi);
+		return true;
+	}
+#endif // BELA_LIBPD_MIDI
+#ifdef BELA_LIBPD_SERIAL
+	case kHookSetSerial:
+		if(gSerialInputTask)
+			fprintf(stderr, "bela_setSerial: the serial port is already open, restart to change it\n");
+		else
+			serialMessage(h.symbol, argc, argv);
+		return true;
+#endif // BELA_LIBPD_SERIAL
+	default:
+		return false;
+	}
+}
+
+// runs in gPatchSwapTask once the new patch is loaded: builds its state in
+// gTrillNext, gGuiNext and gPatchSwapMidi, and leaves in gDeferredHooks the
+// hooks that render() has to run
+static void patchSwapPrepare()
+{
+	unsigned int kept = 0;
+	for(unsigned int n = 0; n < gDeferredHooks.size(); ++n)
+	{
+		if(patchSwapPrepareHook(gDeferredHooks[n]))
+			continue;
+		if(kept != n)
+			gDeferredHooks[kept] = std::move(gDeferredHooks[n]);
+		++kept;
+	}
+	gDeferredHooks.resize(kept);
+#ifdef BELA_LIBPD_TRILL
+	trillAddPolled(gTrillNext);
+#endif // BELA_LIBPD_TRILL
+#ifdef BELA_LIBPD_GUI
+	guiControlsAddKeys(gGuiNext);
+	for(auto& b : gGuiNext.dataBuffers)
+		guiTakeOverBuffer(b);
+#endif // BELA_LIBPD_GUI
+}
+
+// runs in gPatchSwapTask
+static void patchSwapLoad()
+{
+	double start = loadTimeMs();
+	unsigned int referenced = gSubsystemsReferenced;
+	gHookMode = kHooksDefer;
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	t_pdinstance* instance = libpd_new_instance();
+	libpd_set_instance(instance);
+	libpdSetHooks();
+	libpd_add_to_search_path(".");
+	libpd_add_to_search_path("../pd-externals");
+	libpd_init_audio(gChannelsInUse, gChannelsInUse, gPatchSwapSampleRate);
+	float* inBuf = get_sys_soundin();
+	libpd_start_message(1);
+	libpd_add_float(1.0f);
+	libpd_finish_message("pd", "dsp");
+#ifdef PD_THREADED_IO
+	sys_dontmanageio(1);
+#endif /* PD_THREADED_IO */
+	gPatchSwapHooks.rebind(gHooks);
+	void* patch = libpd_openfile(gPatchSwapFile, "./");
+	if(!patch)
+		libpd_free_instance(instance);
+#else // BELA_LIBPD_SWAP_INSTANCES
+	float* inBuf = gInBuf;
+	void* patch = libpd_openfile(gPatchSwapFile, "./");
+#endif // BELA_LIBPD_SWAP_INSTANCES
+	// from here on, what the patches send would be stale by the time
+	// render() hands over
+	gHookMode = kHooksIgnore;
+	if(!patch)
+	{
+		fprintf(stderr, "Error: could not load %s, keeping the current patch\n", gPatchSwapFile);
+		gDeferredHooks.clear();
+		gHookMode = kHooksRun;
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+		gPatchSwapState = kPatchSwapIdle;
+#else // BELA_LIBPD_SWAP_INSTANCES
+		gPatchSwapState = kPatchSwapFadeIn;
+#endif // BELA_LIBPD_SWAP_INSTANCES
+		return;
+	}
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	gPatchSwapInstance = instance;
+	gPatchSwapPatch = patch;
+	gPatchSwapInBuf = inBuf;
+	gPatchSwapOutBuf = get_sys_soundout();
+#else // BELA_LIBPD_SWAP_INSTANCES
+	libpd_closefile(gPatch);
+	gPatch = patch;
+#endif // BELA_LIBPD_SWAP_INSTANCES
+	for(auto& r : gSubsystemReceivers)
+	{
+		if(libpd_exists(r.receiver))
+			gSubsystemsReferenced |= r.subsystem;
+	}
+	memset(inBuf, 0, sizeof(inBuf[0]) * gLibpdBlockSize * gChannelsInUse);
+	for(unsigned int n = 0; n < kPatchSwapWarmupBlocks; ++n)
+		libpd_process_sys();
+	gHookMode = kHooksRun;
+	printf("%s loaded in %.1f ms\n", gPatchSwapFile, loadTimeMs() - start);
+	for(unsigned int n = 0; n < sizeof(gSubsystemNames) / sizeof(gSubsystemNames[0]); ++n)
+	{
+		if((gSubsystemsReferenced & ~referenced & ~gSubsystemsStarted) & (1 << n))
+			fprintf(stderr, "%s uses %s, which will only be started after a restart\n", gPatchSwapFile, gSubsystemNames[n]);
+	}
+	patchSwapPrepare();
+	gPatchSwapState = kPatchSwapReady;
+}
+
+// swaps the state gPatchSwapTask prepared for the new patch with the old
+// patch's. Call from render(), with gGuiControlsLock and gTrillLock held
+static void patchSwapReset()
+{
+#ifdef BELA_LIBPD_GUI
+	for(auto& b : gGui.dataBuffers)
+	{
+		if(b.id >= 0 && b.id < kGuiMaxArrays)
+			gGuiArrays[b.id] = nullptr;
+	}
+	std::swap(gGui, gGuiNext);
+	for(auto& b : gGui.dataBuffers)
+	{
+		if(b.array && b.id < kGuiMaxArrays)
+			gGuiArrays[b.id] = b.array;
+	}
+	if(gSubsystemsStarted & kSubsystemGui)
+	{
+		// drop the messages for the old controls
+		char* message = gRtScratch.get<char>(kRtScratchGui, kGuiMaxControlMessage);
+		while(gGuiPipe.readRt(message, kGuiMaxControlMessage) > 0)
+			;
+	}
+#endif // BELA_LIBPD_GUI
+#ifdef BELA_LIBPD_TRILL
+	std::swap(gTrill, gTrillNext);
+	if(gSubsystemsStarted & kSubsystemTrill)
+	{
+		TrillFrame frame;
+		while(gTrillPipe.readRt((char*)&frame, sizeof(frame)) > 0)
+			;
+	}
+#endif // BELA_LIBPD_TRILL
+#ifdef BELA_LIBPD_MIDI
+	// midi has room for kMidiMaxPorts, see setup()
+	for(auto& m : gPatchSwapMidi)
+	{
+		if(midi.size() >= kMidiMaxPorts)
+			break;
+		midi.push_back(m.second);
+		gMidiPortNames.push_back(std::move(m.first));
+		m.second = nullptr;
+		midiListen(midi.size() - 1);
+	}
+#endif // BELA_LIBPD_MIDI
+#ifdef BELA_LIBPD_OLED
+	gOledState.patchChanged();
+#endif // BELA_LIBPD_OLED
+}
+
+// called by render() once the new patch is ready. If the Gui or the Trill
+// thread is using the state of the old patch, it is tried again at the next
+// callback
+static void patchSwapHandOff()
+{
+	if(!gGuiControlsLock.tryLock())
+		return;
+	if(!gTrillLock.tryLock())
+	{
+		gGuiControlsLock.unlock();
+		return;
+	}
+	patchSwapReset();
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	t_pdinstance* old = gPdInstance;
+	gPdInstance = gPatchSwapInstance;
+	gPatchSwapInstance = old;
+	libpd_set_instance(gPdInstance);
+	std::swap(gPatch, gPatchSwapPatch);
+	std::swap(gInBuf, gPatchSwapInBuf);
+	std::swap(gOutBuf, gPatchSwapOutBuf);
+	std::swap(gHooks, gPatchSwapHooks);
+#endif // BELA_LIBPD_SWAP_INSTANCES
+	for(auto& h : gDeferredHooks)
+		patchSwapRunHook(h);
+	multiplexerPatchLoaded();
+	gTrillLock.unlock();
+	gGuiControlsLock.unlock();
+	gPatchSwapGain = 0;
+	gPatchSwapState = kPatchSwapFadeIn;
+}
+
+// runs in gPatchSwapTask once the new patch has faded in
+static void patchSwapClose()
+{
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	libpd_set_instance(gPatchSwapInstance);
+	gHookMode = kHooksIgnore;
+	libpd_closefile(gPatchSwapPatch);
+	gHookMode = kHooksRun;
+#ifdef PD_THREADED_IO
+	// fdLoop() may not have left the old instance yet
+	unsigned int loops = gIoLoops;
+	while(gIoLoops - loops < 2 && !Bela_stopRequested())
+		usleep(1000);
+#endif /* PD_THREADED_IO */
+	libpd_free_instance(gPatchSwapInstance);
+	gPatchSwapInstance = nullptr;
+#endif // BELA_LIBPD_SWAP_INSTANCES
+#ifdef BELA_LIBPD_TRILL
+	for(auto& t : gTrillNext.sensors)
+		delete t.second;
+	gTrillNext = TrillState();
+#endif // BELA_LIBPD_TRILL
+#ifdef BELA_LIBPD_GUI
+	guiReleaseBuffers(gGuiNext);
+	gGuiNext = GuiState();
+#endif // BELA_LIBPD_GUI
+#ifdef BELA_LIBPD_MIDI
+	for(auto& m : gPatchSwapMidi)
+	{
+		if(m.second)
+			fprintf(stderr, "Too many MIDI ports: closing %s\n", m.first.c_str());
+		delete m.second;
+	}
+	gPatchSwapMidi.clear();
+#endif // BELA_LIBPD_MIDI
+	gDeferredHooks.clear();
+	gPatchSwapState = kPatchSwapIdle;
+}
+
+static void patchSwapTask(void*)
+{
+	if(kPatchSwapLoading == gPatchSwapState)
+		patchSwapLoad();
+	else if(kPatchSwapClosing == gPatchSwapState)
+		patchSwapClose();
+}
+
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+// call after the new patch has processed a block: runs the old one on the
+// same input and mixes their audio outputs, fading the old one out
+static void patchSwapCrossfade(BelaContext* context)
+{
+	memcpy(gPatchSwapInBuf, gInBuf, sizeof(gInBuf[0]) * gLibpdBlockSize * gChannelsInUse);
+	libpd_set_instance(gPatchSwapInstance);
+	gHookMode = kHooksIgnore;
+	libpd_process_sys();
+	gHookMode = kHooksRun;
+	libpd_set_instance(gPdInstance);
+	float step = 1000.f / (kPatchSwapFadeMs * context->audioSampleRate);
+	for(unsigned int ch = 0; ch < context->audioOutChannels; ++ch)
+	{
+		float* out = gOutBuf + ch * gLibpdBlockSize;
+		const float* old = gPatchSwapOutBuf + ch * gLibpdBlockSize;
+		float gain = gPatchSwapGain;
+		for(unsigned int n = 0; n < gLibpdBlockSize; ++n)
+		{
+			gain = std::min(gain + step, 1.f);
+			out[n] = old[n] + (out[n] - old[n]) * gain;
+		}
+	}
+	gPatchSwapGain = std::min(gPatchSwapGain + step * gLibpdBlockSize, 1.f);
+	if(1 == gPatchSwapGain)
+	{
+		gPatchSwapState = kPatchSwapClosing;
+		Bela_scheduleAuxiliaryTask(gPatchSwapTask);
+	}
+}
+#else // BELA_LIBPD_SWAP_INSTANCES
+// ramps the audio output down to silence and back up around a patch swap
+static void patchSwapFade(BelaContext* context)
+{
+	float step = 1000.f / (kPatchSwapFadeMs * context->audioSampleRate);
+	bool fadeOut = kPatchSwapFadeOut == gPatchSwapState;
+	if(!fadeOut)
+		step = -step;
+	for(unsigned int n = 0; n < context->audioFrames; ++n)
+	{
+		gPatchSwapGain = std::min(std::max(gPatchSwapGain - step, 0.f), 1.f);
+		for(unsigned int ch = 0; ch < context->audioOutChannels; ++ch)
+			context->audioOut[ch * context->audioFrames + n] *= gPatchSwapGain;
+	}
+	if(fadeOut && 0 == gPatchSwapGain)
+	{
+		gPatchSwapState = kPatchSwapLoading;
+		Bela_scheduleAuxiliaryTask(gPatchSwapTask);
+	}
+	if(!fadeOut && 1 == gPatchSwapGain)
+	{
+		gPatchSwapState = kPatchSwapClosing;
+		Bela_scheduleAuxiliaryTask(gPatchSwapTask);
+	}
+}
+#endif // BELA_LIBPD_SWAP_INSTANCES
+
+#ifdef BELA_LIBPD_PIPELINE
+#if !defined(PDINSTANCE) || !defined(PDTHREADS)
+#error BELA_LIBPD_PIPELINE requires libpd to be built with PDINSTANCE and PDTHREADS
+#endif
+// The chain can be split in two stages: _main.pd, whose audio outputs are
+// fed to the audio inputs of _stage2.pd, which runs in a second libpd
+// instance. On a multi-core machine _stage2.pd runs in its own thread,
+// processing the previous block while _main.pd processes the current one,
+// at the cost of one block of latency. On a single core it runs after
+// _main.pd in the audio thread.
+// Blocks are handed over through two slots, so that _stage2.pd can fall
+// one block behind without the input being dropped. If it has not
+// finished a block in time, the last output is repeated.
+// The messages sent to the receivers in gPipelineForwarded (and to the
+// digital inputs) reach _stage2.pd if it has a [r] for them, at the start
+// of the block they were sent in. The arrays written by render() and the
+// bela_* receivers that _main.pd sends to are for _main.pd only.
+enum {
+	kPipelineSlots = 2,
+	kPipelineMessageSize = 256,
+	kPipelineQueueSize = 256,
+};
+enum PipelineSlotState {
+	kPipelineFree, // owned by render()
+	kPipelineQueued, // waiting for, or being processed by, _stage2.pd
+	kPipelineDone, // the output is ready
+};
+struct PipelineSlot
+{
+	std::vector<float> in;
+	std::vector<float> out;
+	unsigned int messagesEnd; // where the messages sent before this block end in gPipelineMessages
+	std::atomic<int> state{kPipelineFree};
+};
+// the receiver, the selector and the atoms ('f' and a float, or 's' and a
+// null-terminated string), one after the other
+struct PipelineMessage
+{
+	uint32_t size;
+	char data[kPipelineMessageSize];
+};
+
+// single producer (the audio thread), single consumer (_stage2.pd's thread)
+class PipelineMessageQueue
+{
+public:
+	bool push(const PipelineMessage& message)
+	{
+		unsigned int write = writePtr.load(std::memory_order_relaxed);
+		unsigned int next = (write + 1) % kPipelineQueueSize;
+		if(next == readPtr.load(std::memory_order_acquire))
+			return false;
+		messages[write] = message;
+		writePtr.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// returns nullptr once end, a value of writePosition(), is reached
+	const PipelineMessage* front(unsigned int end)
+	{
+		unsigned int read = readPtr.load(std::memory_order_relaxed);
+		if(read == end)
+			return nullptr;
+		return &messages[read];
+	}
+
+	void pop()
+	{
+		readPtr.store((readPtr.load(std::memory_order_relaxed) + 1) % kPipelineQueueSize, std::memory_order_release);
+	}
+
+	unsigned int writePosition() const
+	{
+		return writePtr.load(std::memory_order_relaxed);
+	}
+
+private:
+	PipelineMessage messages[kPipelineQueueSize];
+	std::atomic<unsigned int> writePtr{0};
+	std::atomic<unsigned int> readPtr{0};
+};
+
+static const char* gPipelineForwarded[] = {
+	"bela_guiControl",
+	"bela_guiPoll",
+	"bela_midiBeat",
+	"bela_midiRunning",
+	"bela_midiTempo",
+	"bela_midiLearned",
+	"#notein",
+	"#ctlin",
+	"#pgmin",
+	"#bendin",
+	"#touchin",
+	"#polytouchin",
+	"#midiin",
+	"#sysexin",
+	"#midirealtimein",
+	"bela_trill",
+	"bela_trillCreated",
+	"bela_serial",
+	"bela_serialOutStatus",
+	"bela_multiplexerControl",
+	"bela_multiplexerChannels",
+	"bela_latency",
+};
+static t_pdinstance* gPipelineStage2;
+static void* gPipelinePatch;
+static float* gPipelineInBuf;
+static float* gPipelineOutBuf;
+static PipelineSlot gPipelineSlots[kPipelineSlots];
+static unsigned int gPipelineSubmit = 0; // the next slot render() fills
+static unsigned int gPipelineCollect = 0; // the next slot render() reads
+static unsigned int gPipelineWorker = 0; // the next slot _stage2.pd processes
+static std::vector<float> gPipelineLast; // the output, repeated if _stage2.pd is late
+static PipelineMessageQueue gPipelineMessages;
+static unsigned int gPipelineMessagesDropped = 0;
+static unsigned int gPipelineFrames;
+static unsigned int gPipelineChannels;
+static bool gPipelineActive = false;
+static bool gPipelineThreaded = false;
+static unsigned int gPipelineOverruns = 0;
+static AuxiliaryTask gPipelineTask;
+
+// appends count bytes to m, returns false if they do not fit
+static bool pipelineAppend(PipelineMessage& m, const void* data, size_t count)
+{
+	if(m.size + count > sizeof(m.data))
+		return false;
+	memcpy(m.data + m.size, data, count);
+	m.size += count;
+	return true;
+}
+
+// called from the hooks of _main.pd's instance for the receivers bound by
+// pipelineSetup()
+static void pipelineForward(const char* receiver, const char* selector, int argc, t_atom* argv)
+{
+	PipelineMessage m;
+	m.size = 0;
+	bool fits = pipelineAppend(m, receiver, strlen(receiver) + 1) && pipelineAppend(m, selector, strlen(selector) + 1);
+	for(int n = 0; n < argc && fits; ++n)
+	{
+		if(libpd_is_float(argv + n))
+		{
+			float value = libpd_get_float(argv + n);
+			fits = pipelineAppend(m, "f", 1) && pipelineAppend(m, &value, sizeof(value));
+		} else if(libpd_is_symbol(argv + n)) {
+			const char* symbol = libpd_get_symbol(argv + n);
+			fits = pipelineAppend(m, "s", 1) && pipelineAppend(m, symbol, strlen(symbol) + 1);
+		}
+	}
+	if(!fits || !gPipelineMessages.push(m))
+	{
+		if(0 == gPipelineMessagesDropped++ % 100)
+			rt_fprintf(stderr, "Message to %s not forwarded to _stage2.pd (%u so far)\n", receiver, gPipelineMessagesDropped);
+	}
+}
+
+// sends m in _stage2.pd's instance
+static void pipelineDeliver(const PipelineMessage& m)
+{
+	const char* end = m.data + m.size;
+	const char* receiver = m.data;
+	const char* selector = receiver + strlen(receiver) + 1;
+	const char* atoms = selector + strlen(selector) + 1;
+	int argc = 0;
+	for(const char* p = atoms; p < end; ++argc)
+		p += 'f' == *p ? 1 + sizeof(float) : 1 + strlen(p + 1) + 1;
+	libpd_start_message(argc);
+	for(const char* p = atoms; p < end;)
+	{
+		if('f' == *p)
+		{
+			float value;
+			memcpy(&value, p + 1, sizeof(value));
+			libpd_add_float(value);
+			p += 1 + sizeof(value);
+		} else {
+			libpd_add_symbol(p + 1);
+			p += 1 + strlen(p + 1) + 1;
+		}
+	}
+	libpd_finish_message(receiver, selector);
+}
+
+// runs _stage2.pd on slot.in, writing slot.out
+static void pipelineRun(PipelineSlot& slot)
+{
+	const PipelineMessage* m;
+	while((m = gPipelineMessages.front(slot.messagesEnd)))
+	{
+		pipelineDeliver(*m);
+		gPipelineMessages.pop();
+	}
+	for(unsigned int tick = 0; tick < gPipelineFrames / gLibpdBlockSize; ++tick)
+	{
+		unsigned int offset = tick * gLibpdBlockSize;
+		for(unsigned int ch = 0; ch < gPipelineChannels; ++ch)
+			memcpy(gPipelineInBuf + ch * gLibpdBlockSize, slot.in.data() + ch * gPipelineFrames + offset, sizeof(float) * gLibpdBlockSize);
+		libpd_process_sys();
+		for(unsigned int ch = 0; ch < gPipelineChannels; ++ch)
+			memcpy(slot.out.data() + ch * gPipelineFrames + offset, gPipelineOutBuf + ch * gLibpdBlockSize, sizeof(float) * gLibpdBlockSize);
+	}
+}
+
+// processes the queued slots, in order
+static void pipelineStage2(void*)
+{
+	libpd_set_instance(gPipelineStage2);
+	while(kPipelineQueued == gPipelineSlots[gPipelineWorker].state)
+	{
+		PipelineSlot& slot = gPipelineSlots[gPipelineWorker];
+		pipelineRun(slot);
+		slot.state = kPipelineDone;
+		gPipelineWorker = (gPipelineWorker + 1) % kPipelineSlots;
+	}
+}
+
+// call after _main.pd has been loaded
+static bool pipelineSetup(BelaContext* context)
+{
+	const char file[] = "_stage2.pd";
+	if(access(file, F_OK) == -1)
+		return true;
+	if(context->audioFrames < gLibpdBlockSize)
+	{
+		fprintf(stderr, "%s is not used: the block size must be at least %d\n", file, gLibpdBlockSize);
+		return true;
+	}
+	gPipelineFrames = context->audioFrames;
+	gPipelineChannels = context->audioOutChannels;
+	for(auto& slot : gPipelineSlots)
+	{
+		slot.in.resize(gPipelineFrames * gPipelineChannels);
+		slot.out.resize(gPipelineFrames * gPipelineChannels);
+	}
+	gPipelineLast.resize(gPipelineFrames * gPipelineChannels);
+	gPipelineStage2 = libpd_new_instance();
+	libpd_set_instance(gPipelineStage2);
+	libpd_set_printhook(Bela_printHook);
+	libpd_add_to_search_path(".");
+	libpd_add_to_search_path("../pd-externals");
+	libpd_init_audio(gPipelineChannels, gPipelineChannels, context->audioSampleRate);
+	gPipelineInBuf = get_sys_soundin();
+	gPipelineOutBuf = get_sys_soundout();
+	libpd_start_message(1);
+	libpd_add_float(1.0f);
+	libpd_finish_message("pd", "dsp");
+	gPipelinePatch = libpd_openfile(file, "./");
+	// the names _stage2.pd receives
+	std::vector<std::string> forwarded;
+	for(auto name : gPipelineForwarded)
+	{
+		if(libpd_exists(name))
+			forwarded.push_back(name);
+	}
+	for(auto& name : gReceiverInputNames)
+	{
+		if(libpd_exists(name.c_str()))
+			forwarded.push_back(name);
+	}
+	libpd_set_instance(gPdInstance);
+	if(!gPipelinePatch)
+	{
+		fprintf(stderr, "Error: file %s is corrupted.\n", file);
+		return false;
+	}
+	for(auto& name : forwarded)
+	{
+		if(kHookNone == gHooks.find(gensym(name.c_str())->s_name).receiver)
+			gHooks.bind(name.c_str(), kHookPipelineForward);
+	}
+	gPipelineThreaded = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	if(gPipelineThreaded)
+		gPipelineTask = Bela_createAuxiliaryTask(pipelineStage2, 90, "pipelineStage2", NULL);
+	gPipelineActive = true;
+	printf("%s runs %s, receiving %u of the bela_* inputs\n", file, gPipelineThreaded ? "in its own thread, one block behind _main.pd" : "after _main.pd", (unsigned int)forwarded.size());
+	return true;
+}
+
+// call once per audio callback, after _main.pd has written the audio outputs
+static void pipelineProcess(BelaContext* context)
+{
+	size_t size = sizeof(float) * gPipelineFrames * gPipelineChannels;
+	if(!gPipelineThreaded)
+	{
+		PipelineSlot& slot = gPipelineSlots[0];
+		memcpy(slot.in.data(), context->audioOut, size);
+		slot.messagesEnd = gPipelineMessages.writePosition();
+		libpd_set_instance(gPipelineStage2);
+		pipelineRun(slot);
+		libpd_set_instance(gPdInstance);
+		memcpy(context->audioOut, slot.out.data(), size);
+		return;
+	}
+	// collect what _stage2.pd has finished. If both slots are done, the
+	// older one is skipped, so that the latency goes back to one block
+	bool collected = false;
+	bool late = kPipelineQueued == gPipelineSlots[gPipelineCollect].state;
+	for(unsigned int n = 0; n < kPipelineSlots && kPipelineDone == gPipelineSlots[gPipelineCollect].state; ++n)
+	{
+		PipelineSlot& slot = gPipelineSlots[gPipelineCollect];
+		gPipelineLast.swap(slot.out);
+		slot.state = kPipelineFree;
+		gPipelineCollect = (gPipelineCollect + 1) % kPipelineSlots;
+		collected = true;
+	}
+	PipelineSlot& slot = gPipelineSlots[gPipelineSubmit];
+	bool submitted = kPipelineFree == slot.state;
+	if(submitted)
+	{
+		memcpy(slot.in.data(), context->audioOut, size);
+		slot.messagesEnd = gPipelineMessages.writePosition();
+		slot.state = kPipelineQueued;
+		gPipelineSubmit = (gPipelineSubmit + 1) % kPipelineSlots;
+		Bela_scheduleAuxiliaryTask(gPipelineTask);
+	}
+	if((!collected && late) || !submitted)
+	{
+		if(0 == gPipelineOverruns++ % 100)
+			rt_fprintf(stderr, "_stage2.pd is late (%u blocks so far)\n", gPipelineOverruns);
+	}
+	memcpy(context->audioOut, gPipelineLast.data(), size);
+}
+#endif // BELA_LIBPD_PIPELINE
+
+// Periods shorter than Pd's block size go through a FIFO: the inputs are
+// accumulated in gInBuf and the outputs are read from gFifoOut, which holds
+// the output of the previous Pd block.
+static std::vector<float> gFifoOut;
+static unsigned int gFifoPos = 0;
+
+// The cost of the callback is measured to report, on [r bela_latency], the
+// current round-trip latency in ms and the shortest period the chain could
+// run at, which can then be set with -p. The latency includes the FIFO, which
+// also delays MIDI input by one Pd block. The peaks decay slowly, so that
+// occasional spikes are remembered for a while.
+static double gLatencyMs;
+static double gLatencyBlockPeak = 0; // ms per Pd block
+static double gLatencyOverheadPeak = 0; // ms per callback, outside of Pd blocks
+static double gLatencyBlocksMs = 0; // spent in Pd blocks in the current callback
+static unsigned int gLatencyReportedPeriod = 0;
+static unsigned int gLatencyReportSamples = 0;
+static constexpr double kLatencyPeakDecay = 0.9999;
+static constexpr double kLatencyBudget = 0.7; // fraction of a period the callback may use
+static constexpr unsigned int kLatencyMinPeriod = 16;
+static constexpr unsigned int kLatencyMaxPeriod = 512;
+
+static unsigned int latencyShortestPeriod(float sampleRate)
+{
+	for(unsigned int period = kLatencyMinPeriod; period < kLatencyMaxPeriod; period *= 2)
+	{
+		// a callback shorter than a Pd block still has to process a whole one
+		unsigned int blocks = std::max(1u, period / gLibpdBlockSize);
+		if(gLatencyOverheadPeak + blocks * gLatencyBlockPeak < kLatencyBudget * 1000.0 * period / sampleRate)
+			return period;
+	}
+	return kLatencyMaxPeriod;
+}
+
+static void latencyUpdate(BelaContext* context, double callbackMs)
+{
+	gLatencyOverheadPeak = std::max(gLatencyOverheadPeak * kLatencyPeakDecay, callbackMs - gLatencyBlocksMs);
+	gLatencyBlocksMs = 0;
+	gLatencyReportSamples += context->audioFrames;
+	if(gLatencyReportSamples < context->audioSampleRate)
+		return;
+	gLatencyReportSamples = 0;
+	unsigned int period = latencyShortestPeriod(context->audioSampleRate);
+	if(period == gLatencyReportedPeriod)
+		return;
+	gLatencyReportedPeriod = period;
+	rt_printf("Latency: %.1f ms, the chain could run with -p %u\n", gLatencyMs, period);
+	libpd_start_message(2);
+	libpd_add_float(gLatencyMs);
+	libpd_add_float(period);
+	libpd_finish_list("bela_latency");
+}
+
+// copies count frames of the inputs, from frame onwards, to gInBuf at offset
+static void pdBlockInput(BelaContext* context, unsigned int frame, unsigned int offset, unsigned int count)
+{
+	//audio input
+	for(unsigned int n = 0; n < context->audioInChannels; ++n)
+	{
+		memcpy(
+			gInBuf + n * gLibpdBlockSize + offset,
+			context->audioIn + frame + n * context->audioFrames, 
+			sizeof(context->audioIn[0]) * count
+		);
+	}
+
+	// analog input
+	for(unsigned int n = 0; n < context->analogInChannels; ++n)
+	{
+		memcpy(
+			gInBuf + gLibpdBlockSize * gFirstAnalogInChannel + n * gLibpdBlockSize + offset,
+			context->analogIn + frame + n * context->analogFrames, 
+			sizeof(context->analogIn[0]) * count
+		);
+	}
+
+	unsigned int j;
+	unsigned int k;
+	float* p0;
+	float* p1;
+	// digital input
+	if(gDigitalEnabled)
+	{
+		// digital in at message-rate
+		dcm.processInput(&context->digital[frame], count);
 
-			Trill* trill = new Trill(bus, device, address);
-			if(Trill::NONE == trill->deviceType())
-			{
-				rt_fprintf(stderr, "Unable to create Trill %s device `%s` on bus %u at ", deviceString, name, bus);
-				if(128 < address)
-					rt_fprintf(stderr, "default address. ");
-				else
-					rt_fprintf(stderr, "address: %#x (%d). ", address, address);
-				rt_fprintf(stderr, "Is the device connected?\n");
-				return;
-			}
-			gTouchSensors.emplace_back(std::string(name), trill);
-			gTrillAcks.push_back(name);
-			//an ack is sent to Pd during the next audio callback because of https://github.com/libpd/libpd/issues/274
-			return;
-		}
-		if(argc < 1 || !libpd_is_symbol(argv))
-		{
-			rt_fprintf(stderr, "bela_setTrill: wrong format. It should be\n"
-					"[<command> <sensor_id> ...(");
-			return;
-		}
-		const char* sensorId = libpd_get_symbol(argv);
-		int idx = getIdxFromId(sensorId, gTouchSensors);
-		if(idx < 0)
-		{
-			rt_fprintf(stderr, "bela_setTrill sensor_id unknown: %s\n", sensorId);
-			return;
-		}
-		if(0 == strcmp(symbol, "updateBaseline"))
-		{
-			gTouchSensors[idx].second->updateBaseline();
-			return;
-		}
-		if(0 == strcmp(symbol, "mode"))
-		{
-			if(argc < 2
-				|| !libpd_is_symbol(argv)
-				|| !libpd_is_symbol(argv + 1)
-			) {
-				setTrillPrintError();
-				return;
-			}
-			const char* modeString = libpd_get_symbol(argv + 1);
-			Trill::Mode mode = Trill::getModeFromName(modeString);
-			gTouchSensors[idx].second->setMode(mode);
-		}
-		if(
-			0 == strcmp(symbol, "threshold")
-			|| 0 == strcmp(symbol, "prescaler")
-		)
-		{
-			if(
-				argc < 2
-				|| !libpd_is_symbol(argv)
-				|| !libpd_is_float(argv + 1)
-			  ) {
-				setTrillPrintError();
-				return;
-			}
-			float value = libpd_get_float(argv + 1);
-			if(0 == strcmp(symbol, "threshold"))
-			{
-				gTouchSensors[idx].second->setNoiseThreshold(value);
-			}
-			if(0 == strcmp(symbol, "prescaler"))
-			{
-				if(Trill::prescalerMax < value || 0 > value)
-				{
-					if(0 == value)
-						value = 0;
-					if(Trill::prescalerMax < value)
-						value = Trill::prescalerMax;
-					rt_printf("bela_setTrill prescaler value out of range, clipping to %u\n", value);
+		// digital in at signal-rate
+		for (j = 0, p0 = gInBuf + offset; j < count; j++, p0++) {
+			unsigned int digitalFrame = frame + j;
+			for (k = 0, p1 = p0 + gLibpdBlockSize * gFirstDigitalChannel;
+					k < 16; ++k, p1 += gLibpdBlockSize) {
+				if(dcm.isSignalRate(k) && dcm.isInput(k)){ // only process input channels that are handled at signal rate
+					*p1 = digitalRead(context, digitalFrame, k);
 				}
-				gTouchSensors[idx].second->setPrescaler(value);
 			}
-			return;
 		}
-		return;
 	}
-#endif // BELA_LIBPD_TRILL
 }
 
-void Bela_floatHook(const char *source, float value){
-	// let's make this as optimized as possible for built-in digital Out parsing
-	// the built-in digital receivers are of the form "bela_digitalOutXX" where XX is between gLibpdDigitalChannelOffset and (gLibpdDigitalCHannelOffset+gDigitalChannelsInUse)
-	static int prefixLength = 15; // strlen("bela_digitalOut")
-	if(strncmp(source, "bela_digitalOut", prefixLength)==0){
-		if(source[prefixLength] != 0){ //the two ifs are used instead of if(strlen(source) >= prefixLength+2)
-			if(source[prefixLength + 1] != 0){
-				// quickly convert the suffix to integer, assuming they are numbers, avoiding to call atoi
-				int receiver = ((source[prefixLength] - 48) * 10);
-				receiver += (source[prefixLength+1] - 48);
-				unsigned int channel = receiver - gLibpdDigitalChannelOffset; // go back to the actual Bela digital channel number
-				if(channel < gDigitalChannelsInUse){ //number of digital channels
-					dcm.setValue(channel, value);
+// copies count frames of out, a Pd output block, from offset onwards to the
+// outputs at frame
+static void pdBlockOutput(BelaContext* context, const float* out, unsigned int offset, unsigned int frame, unsigned int count)
+{
+	unsigned int j;
+	unsigned int k;
+	const float* p0;
+	const float* p1;
+	// digital outputs
+	if(gDigitalEnabled)
+	{
+		// digital out at signal-rate
+		for (j = 0, p0 = out + offset; j < count; ++j, ++p0) {
+			unsigned int digitalFrame = (frame + j);
+			for (k = 0, p1 = p0  + gLibpdBlockSize * gFirstDigitalChannel;
+				k < context->digitalChannels; k++, p1 += gLibpdBlockSize)
+			{
+				if(dcm.isSignalRate(k) && dcm.isOutput(k)){ // only process output channels that are handled at signal rate
+					digitalWriteOnce(context, digitalFrame, k, *p1 > 0.5);
 				}
 			}
 		}
-	}
-}
 
+		// digital out at message-rate
+		dcm.processOutput(&context->digital[frame], count);
+	}
 
+	// audio output
+	for(unsigned int n = 0; n < context->audioOutChannels; ++n)
+	{
+		memcpy(
+			context->audioOut + frame + n * context->audioFrames, 
+			out + n * gLibpdBlockSize + offset,
+			sizeof(context->audioOut[0]) * count
+		);
+	}
 
-std::vector<std::string> gReceiverInputNames;
-std::vector<std::string> gReceiverOutputNames;
-void generateDigitalNames(unsigned int numDigitals, unsigned int libpdOffset, std::vector<std::string>& receiverInputNames, std::vector<std::string>& receiverOutputNames)
-{
-	std::string inBaseString = "bela_digitalIn";
-	std::string outBaseString = "bela_digitalOut";
-	for(unsigned int i = 0; i<numDigitals; i++)
+	//analog output
+	for(unsigned int n = 0; n < context->analogOutChannels; ++n)
 	{
-		receiverInputNames.push_back(inBaseString + std::to_string(i+libpdOffset));
-		receiverOutputNames.push_back(outBaseString + std::to_string(i+libpdOffset));
+		memcpy(
+			context->analogOut + frame + n * context->analogFrames, 
+			out + gLibpdBlockSize * gFirstAnalogOutChannel + n * gLibpdBlockSize + offset,
+			sizeof(context->analogOut[0]) * count
+		);
 	}
 }
 
-void printDigitalNames(std::vector<std::string>& receiverInputNames, std::vector<std::string>& receiverOutputNames)
+// runs Pd on gInBuf, writing gOutBuf
+static void processPdBlock(BelaContext* context)
 {
-	printf("DIGITAL INPUTS\n");
-	for(unsigned int i=0; i<gDigitalChannelsInUse; i++)
-		printf("%s\n", receiverInputNames[i].c_str());
-	printf("DIGITAL OUTPUTS\n");
-	for(unsigned int i=0; i<gDigitalChannelsInUse; i++)
-		printf("%s\n", receiverOutputNames[i].c_str());
-}
-
-static char multiplexerArray[] = {"bela_multiplexer"};
-static int multiplexerArraySize = 0;
-static bool pdMultiplexerActive = false;
-
-#ifdef PD_THREADED_IO
-void fdLoop(void* arg){
-	while(!Bela_stopRequested()){
-		if(!sys_doio(pd_this))
-			usleep(3000);
+	double start = loadTimeMs();
+	// multiplexed analog input
+	if(pdMultiplexerActive)
+	{
+		// we do not disable regular analog inputs if muxer is active, because user may have bridged them on the board and
+		// they may be using half of them at a high sampling-rate
+		static int lastMuxerUpdate = 0;
+		if(++lastMuxerUpdate == multiplexerArraySize){
+			lastMuxerUpdate = 0;
+			multiplexerUpdate(context->multiplexerAnalogIn);
+		}
 	}
-}
-#endif /* PD_THREADED_IO */
+
+	libpd_process_sys(); // process the block
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	if(kPatchSwapFadeIn == gPatchSwapState)
+		patchSwapCrossfade(context);
+#endif // BELA_LIBPD_SWAP_INSTANCES
 
 #ifdef BELA_LIBPD_SCOPE
-Scope scope;
-float* gScopeOut;
+	// scope output
+	if(gScopeConnected)
+		gScopePipe.writeRt(gOutBuf + gLibpdBlockSize * gFirstScopeChannel, gLibpdBlockSize * gScopeChannelsInUse);
 #endif // BELA_LIBPD_SCOPE
-void* gPatch;
-bool gDigitalEnabled = 0;
+	double elapsed = loadTimeMs() - start;
+	gLatencyBlocksMs += elapsed;
+	gLatencyBlockPeak = std::max(gLatencyBlockPeak * kLatencyPeakDecay, elapsed);
+}
 
 bool setup(BelaContext *context, void *userData)
 {
+	gRtScratch.setup();
 
 		//Encoder Modification
 
@@ -877,14 +4558,13 @@ bool setup(BelaContext *context, void *userData)
 		//-------------------------------------------------
 
 
-#ifdef BELA_LIBPD_GUI
-	gui.setup(context->projectName);
-	gui.setControlDataCallback(guiControlDataCallback, nullptr);
-	gGuiPipe.setup("guiControlPipe", 16384);
-#endif // BELA_LIBPD_GUI
 #ifdef BELA_LIBPD_SERIAL
 	gSerialPipe.setup("serialPipe", 16384);
+	gSerialOutPipe.setup("serialOutPipe", 65536);
 #endif // BELA_LIBPD_SERIAL
+#ifdef BELA_LIBPD_OLED
+	gOledState.setup(context->audioSampleRate);
+#endif // BELA_LIBPD_OLED
 	// Check Pd's version
 	int major, minor, bugfix;
 	sys_getversion(&major, &minor, &bugfix);
@@ -906,17 +4586,6 @@ bool setup(BelaContext *context, void *userData)
 	if(context->digitalFrames > 0 && context->digitalChannels > 0)
 		gDigitalEnabled = 1;
 
-#ifdef BELA_LIBPD_MIDI
-	// add here other devices you need 
-	gMidiPortNames.push_back("hw:1,0,0");
-	//gMidiPortNames.push_back("hw:0,0,0");
-	//gMidiPortNames.push_back("hw:1,0,1");
-#endif // BELA_LIBPD_MIDI
-#ifdef BELA_LIBPD_SCOPE
-	scope.setup(gScopeChannelsInUse, context->audioSampleRate);
-	gScopeOut = new float[gScopeChannelsInUse];
-#endif // BELA_LIBPD_SCOPE
-
 	// Check first of all if the patch file exists. Will actually open it later.
 	char file[] = "_main.pd";
 	char folder[] = "./";
@@ -944,6 +4613,13 @@ bool setup(BelaContext *context, void *userData)
 		gFirstDigitalChannel = minFirstDigitalChannel; //for backwards compatibility
 	gLibpdDigitalChannelOffset = gFirstDigitalChannel + 1;
 	gFirstScopeChannel = gFirstDigitalChannel + gDigitalChannelsInUse;
+#ifdef BELA_LIBPD_SCOPE
+	gScopeChannelsInUse = scopeChannelsInPatch(gFirstScopeChannel, folder);
+	printf("Scope channels in use: %u\n", gScopeChannelsInUse);
+	scope.setup(gScopeChannelsInUse, context->audioSampleRate);
+	gScopePipe.setup("scopePipe", 65536);
+	gScopeLogPipe.setup("scopeLogPipe", 65536);
+#endif // BELA_LIBPD_SCOPE
 
 	gChannelsInUse = gFirstScopeChannel + gScopeChannelsInUse;
 	
@@ -962,45 +4638,38 @@ bool setup(BelaContext *context, void *userData)
 	}
 
 #ifdef BELA_LIBPD_MIDI
-	unsigned int n = 0;
-	while(n < gMidiPortNames.size())
-	{
-		Midi* newMidi = openMidiDevice(gMidiPortNames[n], false, false);
-		if(newMidi)
-		{
-			midi.push_back(newMidi);
-			++n;
-		} else {
-			gMidiPortNames.erase(gMidiPortNames.begin() + n);
-		}
-	}
-	dumpMidi();
+	gMidiClock.setup(context->audioSampleRate);
+	midiLearnLoad();
 #endif // BELA_LIBPD_MIDI
 
-	// check that we are not running with a blocksize smaller than gLibPdBlockSize
+	// the block size has to be a multiple of gLibpdBlockSize, or a divisor
+	// of it, in which case a FIFO adds one gLibpdBlockSize of latency
 	gLibpdBlockSize = libpd_blocksize();
-	if(context->audioFrames < gLibpdBlockSize){
-		fprintf(stderr, "Error: minimum block size must be %d\n", gLibpdBlockSize);
+	if(context->audioFrames < gLibpdBlockSize ? gLibpdBlockSize % context->audioFrames : context->audioFrames % gLibpdBlockSize){
+		fprintf(stderr, "Error: the block size must be a multiple or a divisor of %d\n", gLibpdBlockSize);
 		return false;
 	}
+	unsigned int fifoFrames = 0;
+	if(context->audioFrames < gLibpdBlockSize)
+	{
+		fifoFrames = gLibpdBlockSize;
+		gFifoOut.resize(gChannelsInUse * gLibpdBlockSize);
+	}
+	// input and output buffers, plus the FIFO
+	gLatencyMs = 1000.0 * (2 * context->audioFrames + fifoFrames) / context->audioSampleRate;
+	printf("Block size %u, Pd block size %u: about %.1f ms of round-trip latency\n", context->audioFrames, gLibpdBlockSize, gLatencyMs);
 
 	// set hooks before calling libpd_init
-	libpd_set_printhook(Bela_printHook);
-	libpd_set_floathook(Bela_floatHook);
-	libpd_set_listhook(Bela_listHook);
-	libpd_set_messagehook(Bela_messageHook);
-#ifdef BELA_LIBPD_MIDI
-	libpd_set_noteonhook(Bela_MidiOutNoteOn);
-	libpd_set_controlchangehook(Bela_MidiOutControlChange);
-	libpd_set_programchangehook(Bela_MidiOutProgramChange);
-	libpd_set_pitchbendhook(Bela_MidiOutPitchBend);
-	libpd_set_aftertouchhook(Bela_MidiOutAftertouch);
-	libpd_set_polyaftertouchhook(Bela_MidiOutPolyAftertouch);
-	libpd_set_midibytehook(Bela_MidiOutByte);
-#endif // BELA_LIBPD_MIDI
+	libpdSetHooks();
 
 	//initialize libpd. This clears the search path
 	libpd_init();
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	gPdInstance = libpd_this_instance();
+	gPatchSwapSampleRate = context->audioSampleRate;
+#endif // BELA_LIBPD_SWAP_INSTANCES
+	saturateSetup();
+	xfadeSetup();
 	//Add the current folder to the search path for externals
 	libpd_add_to_search_path(".");
 	libpd_add_to_search_path("../pd-externals");
@@ -1015,46 +4684,125 @@ bool setup(BelaContext *context, void *userData)
 	libpd_add_float(1.0f);
 	libpd_finish_message("pd", "dsp");
 
+#ifdef BELA_LIBPD_PROFILE_LOAD
+	profilePatchLoad(folder, file);
+#endif // BELA_LIBPD_PROFILE_LOAD
+
 	// Bind your receivers here
 	for(unsigned int i = 0; i < gDigitalChannelsInUse; i++)
-		libpd_bind(gReceiverOutputNames[i].c_str());
-	libpd_bind("bela_setDigital");
-	libpd_bind("bela_control");
+		gHooks.bind(gReceiverOutputNames[i].c_str(), kHookDigitalOut, i);
+	gHooks.bind("bela_setDigital", kHookSetDigital);
+	gHooks.bind("bela_control", kHookControl);
 #ifdef BELA_LIBPD_MIDI
-	libpd_bind("bela_setMidi");
+	gHooks.bind("bela_setMidi", kHookSetMidi);
+	gHooks.bind("bela_midiClockSync", kHookMidiClockSync);
+	gHooks.bind("bela_midiLearn", kHookMidiLearn);
 #endif // BELA_LIBPD_MIDI
 #ifdef BELA_LIBPD_GUI
-	libpd_bind("bela_guiOut");
-	libpd_bind("bela_setGui");
+	gHooks.bind("bela_guiOut", kHookGuiOut);
+	gHooks.bind("bela_guiTelemetry", kHookGuiTelemetry);
+	gHooks.bind("bela_setGui", kHookSetGui);
 #endif // BELA_LIBPD_GUI
 #ifdef BELA_LIBPD_SERIAL
-	libpd_bind("bela_serialOut");
-	libpd_bind("bela_setSerial");
+	gHooks.bind("bela_serialOut", kHookSerialOut);
+	gHooks.bind("bela_setSerial", kHookSetSerial);
 #endif // BELA_LIBPD_SERIAL
 #ifdef BELA_LIBPD_TRILL
-	libpd_bind("bela_setTrill");
+	gHooks.bind("bela_setTrill", kHookSetTrill);
 #endif // BELA_LIBPD_TRILL
+#ifdef BELA_LIBPD_SCOPE
+	gHooks.bind("bela_setScope", kHookSetScope);
+#endif // BELA_LIBPD_SCOPE
+	gHooks.bind("bela_setMultiplexer", kHookSetMultiplexer);
+	gHooks.bind("bela_loadPatch", kHookLoadPatch);
+#ifdef BELA_LIBPD_OLED
+	gOledState.bindReceivers();
+#endif // BELA_LIBPD_OLED
+#ifdef BELA_LIBPD_MIDI
+	// so that a patch swap can add ports from render() without allocating
+	midi.reserve(kMidiMaxPorts);
+	gMidiPortNames.reserve(kMidiMaxPorts);
+#endif // BELA_LIBPD_MIDI
 
 	// open patch:
+	double loadStart = loadTimeMs();
+	gPatchLoading = true;
 	gPatch = libpd_openfile(file, folder);
+	gPatchLoading = false;
 	if(gPatch == NULL){
 		printf("Error: file %s/%s is corrupted.\n", folder, file); 
 		return false;
 	}
-
-	// If the user wants to use the multiplexer capelet,
-	// the patch will have to contain an array called "bela_multiplexer"
-	// and a receiver [r bela_multiplexerChannels]
-	if(context->multiplexerChannels > 0 && libpd_arraysize(multiplexerArray) >= 0){
-		pdMultiplexerActive = true;
-		multiplexerArraySize = context->multiplexerChannels * context->analogInChannels;
-		// [; bela_multiplexer ` multiplexerArraySize` resize(
-		libpd_start_message(1);
-		libpd_add_float(multiplexerArraySize);
-		libpd_finish_message(multiplexerArray, "resize");
-		// [; bela_multiplexerChannels `context->multiplexerChannels`(
-		libpd_float("bela_multiplexerChannels", context->multiplexerChannels);
+	printf("%s loaded in %.1f ms\n", file, loadTimeMs() - loadStart);
+#ifdef BELA_LIBPD_PIPELINE
+	// before looking at the receivers, as those _stage2.pd has are
+	// forwarded to it
+	if(!pipelineSetup(context))
+		return false;
+#endif // BELA_LIBPD_PIPELINE
+	for(auto& r : gSubsystemReceivers)
+	{
+		if(libpd_exists(r.receiver))
+			gSubsystemsReferenced |= r.subsystem;
+	}
+#ifdef BELA_LIBPD_GUI
+	if(gSubsystemsReferenced & kSubsystemGui)
+	{
+		gui.setup(context->projectName);
+		gui.setControlDataCallback(guiControlDataCallback, nullptr);
+		gui.setBinaryDataCallback(guiBinaryDataCallback, nullptr);
+		gGuiPipe.setup("guiControlPipe", 16384);
+		gSubsystemsStarted |= kSubsystemGui;
+		// arrays declared while the patch was loading can be set up now,
+		// instead of from the audio thread
+		for(auto& b : gGui.dataBuffers)
+			setupGuiDataBuffer(b);
+		guiControlsCommit();
+	}
+#endif // BELA_LIBPD_GUI
+#ifdef BELA_LIBPD_MIDI
+	if(gSubsystemsReferenced & kSubsystemMidi)
+	{
+		// ports added with bela_setMidi while loading are already open
+		unsigned int n = midi.size();
+		// add here other devices you need 
+		gMidiPortNames.push_back("hw:1,0,0");
+		//gMidiPortNames.push_back("hw:0,0,0");
+		//gMidiPortNames.push_back("hw:1,0,1");
+		while(n < gMidiPortNames.size())
+		{
+			Midi* newMidi = openMidiDevice(gMidiPortNames[n], false, false);
+			if(newMidi)
+			{
+				midi.push_back(newMidi);
+				midiListen(midi.size() - 1);
+				++n;
+			} else {
+				gMidiPortNames.erase(gMidiPortNames.begin() + n);
+			}
+		}
+		dumpMidi();
+		gMidiLearnPipe.setup("midiLearnPipe", 16384);
+		gMidiLearnTask = Bela_runAuxiliaryTask(midiLearnSaveLoop, 0);
+		gSubsystemsStarted |= kSubsystemMidi;
 	}
+#endif // BELA_LIBPD_MIDI
+#ifdef BELA_LIBPD_TRILL
+	// the sensors created while loading
+	trillCommit();
+	if(gSubsystemsReferenced & kSubsystemTrill)
+	{
+		gTrillTask = Bela_createAuxiliaryTask(readTouchSensors, 51, "touchSensorRead", NULL);
+		gTrillPipe.setup("trillPipe", 16384);
+		gSubsystemsStarted |= kSubsystemTrill;
+	}
+#endif // BELA_LIBPD_TRILL
+	for(unsigned int n = 0; n < sizeof(gSubsystemNames) / sizeof(gSubsystemNames[0]); ++n)
+		printf("%s: %s\n", gSubsystemNames[n], (gSubsystemsStarted & (1 << n)) ? "started" : "not used by the patch");
+
+	gMultiplexerChannels = context->multiplexerChannels;
+	multiplexerArraySize = context->multiplexerChannels * context->analogInChannels;
+	multiplexerPatchLoaded();
 
 	// Tell Pd that we will manage the io loop,
 	// and we do so in an Auxiliary Task
@@ -1066,198 +4814,161 @@ bool setup(BelaContext *context, void *userData)
 #endif /* PD_THREADED_IO */
 
 	dcm.setVerbose(false);
-#ifdef BELA_LIBPD_TRILL
-	gTrillTask = Bela_createAuxiliaryTask(readTouchSensors, 51, "touchSensorRead", NULL);
-	gTrillPipe.setup("trillPipe", 1024);
-#endif // BELA_LIBPD_TRILL
+	gPatchSwapTask = Bela_createAuxiliaryTask(patchSwapTask, 40, "patchSwap", NULL);
+#ifdef BELA_LIBPD_SCOPE
+	gScopeTask = Bela_runAuxiliaryTask(scopeLoop, 0);
+#endif // BELA_LIBPD_SCOPE
 	return true;
 }
 
 void render(BelaContext *context, void *userData)
 {
+	double callbackStart = loadTimeMs();
+	if(kPatchSwapReady == gPatchSwapState)
+		patchSwapHandOff();
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	libpd_set_instance(gPdInstance);
+#else // BELA_LIBPD_SWAP_INSTANCES
+	if(kPatchSwapLoading == gPatchSwapState || kPatchSwapReady == gPatchSwapState)
+	{
+		// Pd belongs to gPatchSwapTask until the new patch is loaded
+		memset(context->audioOut, 0, sizeof(context->audioOut[0]) * context->audioFrames * context->audioOutChannels);
+		return;
+	}
+#endif // BELA_LIBPD_SWAP_INSTANCES
 #ifdef BELA_LIBPD_GUI
-	while(gGuiControlBuffers.size()) // this won't change within the loop, but it's good not to have to use a separate flag
+	while(gGui.controlBuffers.size()) // this won't change within the loop, but it's good not to have to use a separate flag
 	{
-		static struct guiControlMessageHeader header;
-		static bool waitingForHeader = true;
-		if(waitingForHeader)
+		char* message = gRtScratch.get<char>(kRtScratchGui, kGuiMaxControlMessage);
+		int ret = gGuiPipe.readRt(message, kGuiMaxControlMessage);
+		struct guiControlMessageHeader header;
+		if(ret < int(sizeof(header)))
+			break;
+		memcpy(&header, message, sizeof(header));
+		const char* payload = message + sizeof(header);
+		if(int(sizeof(header) + header.size) != ret)
 		{
-			int ret = gGuiPipe.readRt(header);
-			if(1 != ret)
-				break;
-			else
-				waitingForHeader = false;
+			rt_fprintf(stderr, "Unexpected Gui control message length: %d\n", ret);
+			continue;
 		}
-		if(!waitingForHeader)
+		if('F' == header.type)
 		{
-			char payload[header.size];
-			int ret = gGuiPipe.readRt(&payload[0], header.size);
-			if(int(header.size) != ret)
-			{
-				break;
-			}
-			const char* name = gGuiControlBuffers[header.id].c_str();
-			if('f' == header.type)
+			const guiControlValue* values = (const guiControlValue*)payload;
+			for(unsigned int n = 0; n < header.id && (n + 1) * sizeof(values[0]) <= header.size; ++n)
 			{
-				if(header.size != sizeof(float))
-				{
-					rt_fprintf(stderr, "Unexpected message length for float: %u\n", header.size);
+				if(values[n].id >= gGui.controlBuffers.size())
 					continue;
-				}
-				float value = ((float*)payload)[0];
 				libpd_start_message(1);
-				libpd_add_float(value);
-				libpd_finish_message("bela_guiControl", name);
-			}
-			if('s' == header.type)
-			{
-				libpd_symbol(name, payload);
+				libpd_add_float(values[n].value);
+				libpd_finish_message("bela_guiControl", gGui.controlBuffers[values[n].id].c_str());
 			}
-			waitingForHeader = true;
+			continue;
 		}
-	}
-	for(auto& b : gGuiDataBuffers)
-	{
-		int id = b.id;
-		int size = b.size;
-		const char* name = b.name.c_str();
-		if(id < 0)
+		if(header.id >= gGui.controlBuffers.size())
+			continue;
+		const char* name = gGui.controlBuffers[header.id].c_str();
+		if('f' == header.type)
 		{
-			// initialize
-			size = libpd_arraysize(name);
-			if(size <= 0)
+			if(header.size != sizeof(float))
 			{
+				rt_fprintf(stderr, "Unexpected message length for float: %u\n", header.size);
 				continue;
-			} else {
-				// this is thread-unsafe: what happens if this causes reallocation while the Gui thread is writing to a buffer?
-				id = gui.setBuffer('f', size);
-				b.id = id;
-				b.size = size;
-				DataBuffer& dataBuffer = gui.getDataBuffer(id);
-				// initialize gui buffer with the initial content of the array
-				libpd_read_array(dataBuffer.getAsFloat(), b.name.c_str(), 0, size);
 			}
+			float value;
+			memcpy(&value, payload, sizeof(value));
+			libpd_start_message(1);
+			libpd_add_float(value);
+			libpd_finish_message("bela_guiControl", name);
+		}
+		if('s' == header.type)
+		{
+			libpd_symbol(name, payload);
 		}
-		DataBuffer& dataBuffer = gui.getDataBuffer(b.id);
-		libpd_write_array(b.name.c_str(), 0, dataBuffer.getAsFloat(), dataBuffer.getNumElements());
+	}
+	for(auto& b : gGui.dataBuffers)
+	{
+		// arrays declared after the patch was loaded are set up here
+		// this is thread-unsafe: what happens if this causes reallocation while the Gui thread is writing to a buffer?
+		if(b.id < 0 && !setupGuiDataBuffer(b))
+			continue;
+		unsigned int count;
+		const float* data = b.array->read(count);
+		if(data)
+			libpd_write_array(b.name.c_str(), 0, data, count);
+	}
+	guiControlsCommit();
+	gGuiTelemetrySamples += context->audioFrames;
+	if((gSubsystemsStarted & kSubsystemGui) && gGuiTelemetrySamples >= context->audioSampleRate / gGuiTelemetryRate)
+	{
+		gGuiTelemetrySamples = 0;
+		libpd_bang("bela_guiPoll");
 	}
 #endif // BELA_LIBPD_GUI
 #ifdef BELA_LIBPD_SERIAL
 	while(gSerialInputTask) // proxy for 'isEnabled. Using `while` so we can do early return
 	{
-		enum WaitingFor_t {
-			kHeader,
-			kId,
-			kData,
-		};
-		static struct serialMessageHeader h;
-		static enum WaitingFor_t waitingFor = kHeader;
-		static char id[100];
-		if(kHeader == waitingFor)
-		{
-			int ret = gSerialPipe.readRt(h);
-			if(ret <= 0)
-				break;
-			waitingFor = kId;
+		char* message = gRtScratch.get<char>(kRtScratchSerial, RtScratch::capacity<char>());
+		int ret = gSerialPipe.readRt(message, RtScratch::capacity<char>());
+		if(ret <= 0)
+			break;
+		serialMessageHeader h;
+		memcpy(&h, message, std::min(sizeof(h), size_t(ret)));
+		const char* data = message + sizeof(h);
+		const uint32_t* offsets = (const uint32_t*)(data + serialPadded(h.dataSize));
+		if(ret < int(sizeof(h)) || !h.dataSize || int(sizeof(h) + serialPadded(h.dataSize) + h.numTokens * sizeof(offsets[0])) != ret)
+		{
+			rt_fprintf(stderr, "Invalid message read from gSerialPipe: %d bytes\n", ret);
+			continue;
 		}
-		if(kId == waitingFor)
+		const char* rec = "bela_serial";
+		if(kSerialSymbol == gSerialType)
 		{
-			if(h.idSize > sizeof(id) - 1)
-				rt_fprintf(stderr, "Serial: ID too large\n");
-			else
+			libpd_symbol(rec, data);
+		} else if(h.numTokens) {
+			libpd_start_message(h.numTokens);
+			for(unsigned int n = 0; n < h.numTokens; ++n)
 			{
-				int ret = gSerialPipe.readRt(id, h.idSize);
-				if(ret <= 0)
-					break;
-				if(int(h.idSize) != ret)
-				{
-					rt_fprintf(stderr, "Invalid number of bytes read from gSerialPipe. Expected: %u, got %u\n", h.idSize, ret);
-					break;
-				}
-				id[ret] = '\0'; // ensure it's null-terminated
-				waitingFor = kData;
+				const char* token = data + offsets[n];
+				if(kSerialSymbols == gSerialType)
+					libpd_add_symbol(token);
+				else if (kSerialFloats == gSerialType)
+					libpd_add_float(serialParseFloat(token));
 			}
+			libpd_finish_message(rec, gSerialId.c_str());
 		}
-		if(kData == waitingFor)
+	}
+	if(gSerialOutputTask)
+	{
+		uint32_t pending = gSerialOutQueued - gSerialOutWritten;
+		bool busy = pending > kSerialOutHighWater;
+		if(busy != gSerialOutBusy || gSerialOutDropped != gSerialOutDroppedReported)
 		{
-			char data[h.dataSize + 1];
-			int ret = gSerialPipe.readRt(data, h.dataSize);
-			if(ret <= 0)
-				break;
-			if(int(h.dataSize) != ret)
-			{
-				rt_fprintf(stderr, "Invalid number of bytes read from gSerialPipe. Expected: %u, got %u\n", h.dataSize, ret);
-				break;
-			}
-			data[h.dataSize] = '\0'; // ensure it's null-terminated
-			if(h.dataSize)
-			{
-				const char* rec = "bela_serial";
-				if(kSerialSymbol == gSerialType)
-				{
-					libpd_symbol(rec, data);
-				} else {
-					unsigned int nTokens = 1;
-					const uint8_t separators[] = { ' ', '\0'};
-					// find number of delimiters
-					size_t start = 0;
-					for(size_t n = 0; n < sizeof(data); ++n)
-					{
-						for(size_t c = 0; c < sizeof(separators); ++c)
-						{
-							if(separators[c] == data[n] && n != start) // exclude empty tokens
-							{
-								start = n + 1;
-								nTokens++;
-							}
-						}
-					}
-					libpd_start_message(nTokens);
-					start = 0;
-					for(size_t n = 0; n < sizeof(data); ++n)
-					{
-						bool end = false;
-						for(size_t c = 0; c < sizeof(separators); ++c)
-						{
-							if(separators[c] == data[n])
-							{
-								if(start == n)
-									start++; // remove empty tokens
-								else
-									end = true;
-								break; // no need to check for more separators
-							}
-						}
-						if(end)
-						{
-							data[n] = '\0'; // ensure the string is null-terminated so the next line works
-							if(kSerialSymbols == gSerialType)
-								libpd_add_symbol(data + start);
-							else if (kSerialFloats == gSerialType)
-								libpd_add_float(atof(data + start));
-							start = n + 1;
-						}
-					}
-					libpd_finish_message("bela_serial", id);
-				}
-			}
-			waitingFor = kHeader;
+			gSerialOutBusy = busy;
+			gSerialOutDroppedReported = gSerialOutDropped;
+			libpd_start_message(3);
+			libpd_add_float(busy);
+			libpd_add_float(pending);
+			libpd_add_float(gSerialOutDropped);
+			libpd_finish_list("bela_serialOutStatus");
 		}
 	}
 #endif // BELA_LIBPD_SERIAL
 #ifdef BELA_LIBPD_TRILL
-	for(auto& name : gTrillAcks)
+	for(auto& name : gTrill.acks)
 	{
-		unsigned int idx = getIdxFromId(name.c_str(), gTouchSensors);
+		unsigned int idx = getIdxFromId(name.c_str(), gTrill.sensors);
+		// the patch has been loaded by now, so its arrays exist
+		gTrill.arraySizes[idx] = libpd_arraysize(gTrill.arrayNames[idx].c_str());
 		libpd_start_message(3);
-		libpd_add_symbol(Trill::getNameFromDevice(gTouchSensors[idx].second->deviceType()).c_str());
-		libpd_add_float(gTouchSensors[idx].second->getAddress());
-		libpd_add_symbol(Trill::getNameFromMode(gTouchSensors[idx].second->getMode()).c_str());
+		libpd_add_symbol(Trill::getNameFromDevice(gTrill.sensors[idx].second->deviceType()).c_str());
+		libpd_add_float(gTrill.sensors[idx].second->getAddress());
+		libpd_add_symbol(Trill::getNameFromMode(gTrill.sensors[idx].second->getMode()).c_str());
 		libpd_finish_message("bela_trillCreated", name.c_str());
 	}
-	gTrillAcks.resize(0);
+	gTrill.acks.resize(0);
+	trillCommit();
 	bool doTrill = false;
-	for(auto& t : gTouchSensors)
+	for(auto& t : gTrill.sensors)
 	{
 		if(Trill::NONE != t.second->deviceType())
 		{
@@ -1267,45 +4978,24 @@ void render(BelaContext *context, void *userData)
 	}
 	if(doTrill)
 	{
-		int idx;
-		while(gTrillPipe.readRt(idx) > 0)
+		TrillFrame frame;
+		while(gTrillPipe.readRt((char*)&frame, sizeof(frame)) >= (int)offsetof(TrillFrame, values))
 		{
-			Trill& touchSensor = *gTouchSensors[idx].second;
-			const char* sensorId = gTouchSensors[idx].first.c_str();
-			if(Trill::Device::NONE == touchSensor.deviceType())
+			if(frame.sensor >= gTrill.sensors.size())
 				continue;
-
-			const Trill::Mode mode = touchSensor.getMode();
-			if(Trill::DIFF == mode || Trill::RAW == mode || Trill::BASELINE == mode)
+			const char* sensorId = gTrill.sensors[frame.sensor].first.c_str();
+			const char* arrayName = gTrill.arrayNames[frame.sensor].c_str();
+			if(frame.raw && gTrill.arraySizes[frame.sensor] >= (int)frame.count)
 			{
-				libpd_start_message(touchSensor.getNumChannels());
-				for(unsigned int n = 0; n < touchSensor.getNumChannels(); ++n)
-				{
-					libpd_add_float(touchSensor.rawData[n]);
-				}
-			} else if(Trill::CENTROID == mode)
-			{
-				if(touchSensor.is1D()) {
-					libpd_start_message(2 * touchSensor.getNumTouches() + 1);
-					libpd_add_float(touchSensor.getNumTouches());
-					for(unsigned int i = 0; i < touchSensor.getNumTouches(); i++) {
-						libpd_add_float(touchSensor.touchLocation(i));
-						libpd_add_float(touchSensor.touchSize(i));
-					}
-				} else if (touchSensor.is2D()) {
-					int numTouches = touchSensor.compoundTouchSize() > 0;
-					libpd_start_message(2 * numTouches + 1);
-					libpd_add_float(numTouches > 0);
-					if(numTouches)
-					{
-						libpd_add_float(touchSensor.compoundTouchHorizontalLocation());
-						libpd_add_float(touchSensor.compoundTouchLocation());
-						libpd_add_float(touchSensor.compoundTouchSize());
-					}
-				}
-			}
-			else
+				libpd_write_array(arrayName, 0, frame.values, frame.count);
+				libpd_start_message(1);
+				libpd_add_float(frame.count);
+				libpd_finish_message("bela_trillArray", sensorId);
 				continue;
+			}
+			libpd_start_message(frame.count);
+			for(unsigned int n = 0; n < frame.count; ++n)
+				libpd_add_float(frame.values[n]);
 			libpd_finish_message("bela_trill", sensorId);
 		}
 
@@ -1315,95 +5005,29 @@ void render(BelaContext *context, void *userData)
 		if(count > readIntervalSamples)
 		{
 			Bela_scheduleAuxiliaryTask(gTrillTask);
-			count -= readIntervalSamples;
+			// the interval may have just shrunk: do not try to catch up
+			count = std::min(count - readIntervalSamples, readIntervalSamples);
 		}
 	}
 #endif // BELA_LIBPD_TRILL
 #ifdef BELA_LIBPD_MIDI
 #ifdef PARSE_MIDI
-	int num;
-	for(unsigned int port = 0; port < midi.size(); ++port){
-		while((num = midi[port]->getParser()->numAvailableMessages()) > 0){
-			static MidiChannelMessage message;
-			message = midi[port]->getParser()->getNextChannelMessage();
-			if(gMidiVerbose >= kMidiVerbosePrintLevel)
-			{
-				rt_printf("On port %d (%s): ", port, gMidiPortNames[port].c_str());
-				message.prettyPrint(); // use this to print beautified message (channel, data bytes)
-			}
-			switch(message.getType()){
-				case kmmNoteOn:
-				{
-					int noteNumber = message.getDataByte(0);
-					int velocity = message.getDataByte(1);
-					int channel = message.getChannel();
-					libpd_noteon(channel + port * 16, noteNumber, velocity);
-					break;
-				}
-				case kmmNoteOff:
-				{
-					/* PureData does not seem to handle noteoff messages as per the MIDI specs,
-					 * so that the noteoff velocity is ignored. Here we convert them to noteon
-					 * with a velocity of 0.
-					 */
-					int noteNumber = message.getDataByte(0);
-	//				int velocity = message.getDataByte(1); // would be ignored by Pd
-					int channel = message.getChannel();
-					libpd_noteon(channel + port * 16, noteNumber, 0);
-					break;
-				}
-				case kmmControlChange:
-				{
-					int channel = message.getChannel();
-					int controller = message.getDataByte(0);
-					int value = message.getDataByte(1);
-					libpd_controlchange(channel + port * 16, controller, value);
-					break;
-				}
-				case kmmProgramChange:
-				{
-					int channel = message.getChannel();
-					int program = message.getDataByte(0);
-					libpd_programchange(channel + port * 16, program);
-					break;
-				}
-				case kmmPolyphonicKeyPressure:
-				{
-					int channel = message.getChannel();
-					int pitch = message.getDataByte(0);
-					int value = message.getDataByte(1);
-					libpd_polyaftertouch(channel + port * 16, pitch, value);
-					break;
-				}
-				case kmmChannelPressure:
-				{
-					int channel = message.getChannel();
-					int value = message.getDataByte(0);
-					libpd_aftertouch(channel + port * 16, value);
-					break;
-				}
-				case kmmPitchBend:
-				{
-					int channel = message.getChannel();
-					int value =  ((message.getDataByte(1) << 7)| message.getDataByte(0)) - 8192;
-					libpd_pitchbend(channel + port * 16, value);
-					break;
-				}
-				case kmmSystem:
-				// currently Bela only handles sysrealtime, and it does so pretending it is a channel message with no data bytes, so we have to re-assemble the status byte
-				{
-					int channel = message.getChannel();
-					int status = message.getStatusByte();
-					int byte = channel | status;
-					libpd_sysrealtime(port, byte);
-					break;
-				}
-				case kmmNone:
-				case kmmAny:
-					break;
-			}
-		}
+	gMidiPrevBlockTime = gMidiBlockTime;
+	gMidiBlockTime = midiNow();
+	unsigned int midiEventsLeft = kMidiMaxEventsPerBlock;
+	// events are timestamped with the frame at which their effect is heard:
+	// with the FIFO, that is one Pd block after the current callback
+	uint64_t midiBlockStart = context->audioFramesElapsed;
+	if(context->audioFrames < gLibpdBlockSize)
+		midiBlockStart += gLibpdBlockSize;
+	unsigned int midiDropped = gMidiDroppedEvents;
+	static unsigned int midiDroppedReported = 0;
+	if(midiDropped != midiDroppedReported)
+	{
+		rt_fprintf(stderr, "MIDI input queue full: %u events dropped\n", midiDropped - midiDroppedReported);
+		midiDroppedReported = midiDropped;
 	}
+	midiClockUpdate(midiBlockStart);
 #else
 	int input;
 	for(unsigned int port = 0; port < NUM_MIDI_PORTS; ++port){
@@ -1413,117 +5037,50 @@ void render(BelaContext *context, void *userData)
 	}
 #endif /* PARSE_MIDI */
 #endif // BELA_LIBPD_MIDI
-	unsigned int numberOfPdBlocksToProcess = context->audioFrames / gLibpdBlockSize;
-
 	// Remember: we have non-interleaved buffers and the same sampling rate for
 	// analogs, audio and digitals
-	for(unsigned int tick = 0; tick < numberOfPdBlocksToProcess; ++tick)
+	if(context->audioFrames < gLibpdBlockSize)
 	{
-		//audio input
-		for(unsigned int n = 0; n < context->audioInChannels; ++n)
-		{
-			memcpy(
-				gInBuf + n * gLibpdBlockSize,
-				context->audioIn + tick * gLibpdBlockSize + n * context->audioFrames, 
-				sizeof(context->audioIn[0]) * gLibpdBlockSize
-			);
-		}
-
-		// analog input
-		for(unsigned int n = 0; n < context->analogInChannels; ++n)
-		{
-			memcpy(
-				gInBuf + gLibpdBlockSize * gFirstAnalogInChannel + n * gLibpdBlockSize,
-				context->analogIn + tick * gLibpdBlockSize + n * context->analogFrames, 
-				sizeof(context->analogIn[0]) * gLibpdBlockSize
-			);
-		}
-		// multiplexed analog input
-		if(pdMultiplexerActive)
+		// the outputs are those of the previous Pd block, one block late
+#if defined(BELA_LIBPD_MIDI) && defined(PARSE_MIDI)
+		midiDispatch(context->audioFrames, context->audioFrames, midiBlockStart, midiEventsLeft);
+#endif // BELA_LIBPD_MIDI && PARSE_MIDI
+		pdBlockInput(context, 0, gFifoPos, context->audioFrames);
+		pdBlockOutput(context, gFifoOut.data(), gFifoPos, 0, context->audioFrames);
+		gFifoPos += context->audioFrames;
+		if(gLibpdBlockSize == gFifoPos)
 		{
-			// we do not disable regular analog inputs if muxer is active, because user may have bridged them on the board and
-			// they may be using half of them at a high sampling-rate
-			static int lastMuxerUpdate = 0;
-			if(++lastMuxerUpdate == multiplexerArraySize){
-				lastMuxerUpdate = 0;
-				libpd_write_array(multiplexerArray, 0, (float *const)context->multiplexerAnalogIn, multiplexerArraySize);
-			}
-		}
-
-		unsigned int digitalFrameBase = gLibpdBlockSize * tick;
-		unsigned int j;
-		unsigned int k;
-		float* p0;
-		float* p1;
-		// digital input
-		if(gDigitalEnabled)
-		{
-			// digital in at message-rate
-			dcm.processInput(&context->digital[digitalFrameBase], gLibpdBlockSize);
-
-			// digital in at signal-rate
-			for (j = 0, p0 = gInBuf; j < gLibpdBlockSize; j++, p0++) {
-				unsigned int digitalFrame = digitalFrameBase + j;
-				for (k = 0, p1 = p0 + gLibpdBlockSize * gFirstDigitalChannel;
-						k < 16; ++k, p1 += gLibpdBlockSize) {
-					if(dcm.isSignalRate(k) && dcm.isInput(k)){ // only process input channels that are handled at signal rate
-						*p1 = digitalRead(context, digitalFrame, k);
-					}
-				}
-			}
+			gFifoPos = 0;
+			processPdBlock(context);
+			memcpy(gFifoOut.data(), gOutBuf, sizeof(gOutBuf[0]) * gFifoOut.size());
 		}
-
-		libpd_process_sys(); // process the block
-
-		// digital outputs
-		if(gDigitalEnabled)
+	} else {
+		for(unsigned int tick = 0; tick < context->audioFrames / gLibpdBlockSize; ++tick)
 		{
-			// digital out at signal-rate
-			for (j = 0, p0 = gOutBuf; j < gLibpdBlockSize; ++j, ++p0) {
-				unsigned int digitalFrame = (digitalFrameBase + j);
-				for (k = 0, p1 = p0  + gLibpdBlockSize * gFirstDigitalChannel;
-					k < context->digitalChannels; k++, p1 += gLibpdBlockSize)
-				{
-					if(dcm.isSignalRate(k) && dcm.isOutput(k)){ // only process output channels that are handled at signal rate
-						digitalWriteOnce(context, digitalFrame, k, *p1 > 0.5);
-					}
-				}
-			}
-
-			// digital out at message-rate
-			dcm.processOutput(&context->digital[digitalFrameBase], gLibpdBlockSize);
+#if defined(BELA_LIBPD_MIDI) && defined(PARSE_MIDI)
+			midiDispatch(context->audioFrames, (tick + 1) * gLibpdBlockSize, midiBlockStart, midiEventsLeft);
+#endif // BELA_LIBPD_MIDI && PARSE_MIDI
+			pdBlockInput(context, tick * gLibpdBlockSize, 0, gLibpdBlockSize);
+			processPdBlock(context);
+			pdBlockOutput(context, gOutBuf, 0, tick * gLibpdBlockSize, gLibpdBlockSize);
 		}
-
+	}
+#ifdef BELA_LIBPD_PIPELINE
+	if(gPipelineActive)
+		pipelineProcess(context);
+#endif // BELA_LIBPD_PIPELINE
 #ifdef BELA_LIBPD_SCOPE
-		// scope output
-		for (j = 0, p0 = gOutBuf; j < gLibpdBlockSize; ++j, ++p0) {
-			for (k = 0, p1 = p0 + gLibpdBlockSize * gFirstScopeChannel; k < gScopeChannelsInUse; k++, p1 += gLibpdBlockSize) {
-				gScopeOut[k] = *p1;
-			}
-			scope.log(gScopeOut[0], gScopeOut[1], gScopeOut[2], gScopeOut[3]);
-		}
+	scopeLog(context);
 #endif // BELA_LIBPD_SCOPE
-
-		// audio output
-		for(unsigned int n = 0; n < context->audioOutChannels; ++n)
-		{
-			memcpy(
-				context->audioOut + tick * gLibpdBlockSize + n * context->audioFrames, 
-				gOutBuf + n * gLibpdBlockSize,
-				sizeof(context->audioOut[0]) * gLibpdBlockSize
-			);
-		}
-
-		//analog output
-		for(unsigned int n = 0; n < context->analogOutChannels; ++n)
-		{
-			memcpy(
-				context->analogOut + tick * gLibpdBlockSize + n * context->analogFrames, 
-				gOutBuf + gLibpdBlockSize * gFirstAnalogOutChannel + n * gLibpdBlockSize,
-				sizeof(context->analogOut[0]) * gLibpdBlockSize
-			);
-		}
-	}
+#ifndef BELA_LIBPD_SWAP_INSTANCES
+	if(kPatchSwapFadeOut == gPatchSwapState || kPatchSwapFadeIn == gPatchSwapState)
+		patchSwapFade(context);
+#endif // BELA_LIBPD_SWAP_INSTANCES
+	latencyUpdate(context, loadTimeMs() - callbackStart);
+#ifdef BELA_LIBPD_OLED
+	gOledState.process(context->audioFrames);
+	gOledState.processAudio(context);
+#endif // BELA_LIBPD_OLED
 
 		//Encoder Modification
 
@@ -1720,14 +5277,25 @@ void cleanup(BelaContext *context, void *userData)
 	}
 #endif // BELA_LIBPD_MIDI
 #ifdef BELA_LIBPD_TRILL
-	for(auto t : gTouchSensors)
+	for(auto t : gTrill.sensors)
 	{
 		// t.first is a std::string, so the memory will be deallocated automatically
 		delete t.second;
 	}
+	for(auto t : gTrillNext.sensors)
+		delete t.second;
 #endif // BELA_LIBPD_TRILL
+#ifdef BELA_LIBPD_SWAP_INSTANCES
+	libpd_set_instance(gPdInstance);
+#endif // BELA_LIBPD_SWAP_INSTANCES
 	libpd_closefile(gPatch);
-#ifdef BELA_LIBPD_SCOPE
-	delete [] gScopeOut;
-#endif // BELA_LIBPD_SCOPE
+#ifdef BELA_LIBPD_PIPELINE
+	if(gPipelineActive)
+	{
+		libpd_set_instance(gPipelineStage2);
+		libpd_closefile(gPipelinePatch);
+		libpd_set_instance(gPdInstance);
+		libpd_free_instance(gPipelineStage2);
+	}
+#endif // BELA_LIBPD_PIPELINE
 }
@@ -8,10 +8,75 @@
 // https://learn.bela.io/the-ide/crafting-guis/
 
 
+// Control values are batched and sent once per frame as a binary message:
+// a magic number followed by one (id, value) pair per control, where id is a
+// hash of the control name (see guiControlFrame() in render.cpp).
+const controlFrameMagic = 0x31465342;
+let pendingControls = new Map();
+
+function controlId(name) {
+	// 32-bit FNV-1a
+	let hash = 0x811c9dc5;
+	for (let i = 0; i < name.length; i++) {
+		hash ^= name.charCodeAt(i);
+		hash = Math.imul(hash, 0x01000193) >>> 0;
+	}
+	return hash;
+}
+
+const controlIds = {};
+for (const name of ['mouseX', 'mouseY', 'windowWidth', 'windowHeight', 'telemetryRate'])
+	controlIds[name] = controlId(name);
+
+function queueControl(name, value) {
+	// only the latest value of each control in a frame is sent
+	pendingControls.set(name, value);
+}
+
+function flushControls() {
+	if (!pendingControls.size)
+		return;
+	let ws = Bela.data.ws;
+	if (!ws || ws.readyState !== WebSocket.OPEN) {
+		// not connected yet: fall back to JSON
+		Bela.control.send(Object.fromEntries(pendingControls));
+	} else {
+		let frame = new DataView(new ArrayBuffer(4 + 8 * pendingControls.size));
+		frame.setUint32(0, controlFrameMagic, true);
+		let offset = 4;
+		for (const [name, value] of pendingControls) {
+			frame.setUint32(offset, controlIds[name], true);
+			frame.setFloat32(offset + 4, value, true);
+			offset += 8;
+		}
+		ws.send(frame.buffer);
+	}
+	pendingControls.clear();
+}
+
+// render.cpp sends the encoder values at most 30 times per second, and only
+// when they change. If we can't keep up (e.g.: slow device or Wi-Fi), ask
+// for fewer updates.
+let telemetryRate = 30;
+let lastRateCheck = 0;
+
+function adaptTelemetryRate() {
+	if (millis() - lastRateCheck < 2000)
+		return;
+	lastRateCheck = millis();
+	let rate = frameRate() < 20 ? 10 : 30;
+	if (rate !== telemetryRate) {
+		telemetryRate = rate;
+		queueControl('telemetryRate', rate);
+	}
+}
+
 function setup() {
 	
 createCanvas(windowWidth, windowHeight);
-Bela.control.send({windowWidth: windowWidth, windowHeight: windowHeight});
+queueControl('windowWidth', windowWidth);
+queueControl('windowHeight', windowHeight);
+flushControls();
     
 }
 
@@ -31,11 +96,14 @@ function draw () {
         
     let center = windowWidth/2 -2.5;
     
-      for (var n = 0; n < touches.length; n++) {
+      if (touches.length) {
 
-	Bela.control.send({mouseX: mouseX, mouseY: mouseY});
+	queueControl('mouseX', mouseX);
+	queueControl('mouseY', mouseY);
 	
   }
+  adaptTelemetryRate();
+  flushControls();
     
     // Change effect if value 5 changed
     
@@ -89,22 +89,123 @@ times a second.
 */
 
 #include <signal.h>
+#include <math.h>
 #include <libraries/OscReceiver/OscReceiver.h>
 #include <unistd.h>
+#include <string.h>
 #include "u8g2/U8g2LinuxI2C.h"
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <string>
+#include <map>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 const unsigned int gI2cBus = 1;
 
 // #define I2C_MUX // allow I2C multiplexing to select different target displays
-struct Display {U8G2 d; int mux;};
+// #define OLED_HEADLESS // draw into memory instead of on the I2C displays, for use with --dump and --replay
+
+#ifdef OLED_HEADLESS
+// A display that is not connected to anything: u8g2 draws into our
+// framebuffer as usual, but flushing a frame only dumps it to disk (if
+// requested with --dump).
+class U8G2Virtual : public U8G2
+{
+public:
+	U8G2Virtual(const u8g2_cb_t* rotation, unsigned int bus, unsigned int address, void (*setup)(u8g2_t*, const u8g2_cb_t*, u8x8_msg_cb, u8x8_msg_cb)) : U8G2()
+	{
+		setup(&u8g2, rotation, u8x8_byte_empty, u8x8_dummy_cb);
+	}
+};
+typedef U8G2Virtual DisplayDriver;
+#else // OLED_HEADLESS
+typedef U8G2LinuxI2C DisplayDriver;
+#endif // OLED_HEADLESS
+
+/// Live data drawn on top of the page whenever a /stream message is received
+typedef enum {
+	kOverlayNone, ///< Nothing (e.g.: the logo is shown)
+	kOverlayMeters, ///< Input and output level meters on the sides of the screen
+	kOverlayLooper, ///< Meters, scrolling waveform and looper position bar
+} Overlay;
+struct Display {U8G2 d; int mux; Overlay overlay = kOverlayNone;};
 std::vector<Display> gDisplays = {
 	// use `-1` as the last value to indicate that the display is not behind a mux, or a number between 0 and 7 for its muxed channel number
-	{U8G2LinuxI2C(U8G2_R0, gI2cBus, 0x3c, u8g2_Setup_ssd1306_i2c_128x64_noname_f), -1},
-	// add more displays / addresses here
+	{DisplayDriver(U8G2_R0, gI2cBus, 0x3c, u8g2_Setup_ssd1306_i2c_128x64_noname_f), -1},
+	// add more displays / addresses here, e.g.: a second screen for the looper and expression status
+	// {DisplayDriver(U8G2_R0, gI2cBus, 0x3d, u8g2_Setup_ssd1306_i2c_128x64_noname_f), -1},
 };
 
+// Each display owns its framebuffers and a worker thread which flushes them
+// to the screen, so that drawing (on the OSC thread) never waits for the I2C
+// bus. If several frames are drawn while a flush is in progress, only the
+// latest one is sent. Only the 8x8 tiles that were drawn on are flushed:
+// each row of tiles has a mask with one bit per tile.
+struct Framebuffer
+{
+	std::vector<uint8_t> draw; // u8g2 draws in here
+	std::vector<uint8_t> pending; // latest complete frame, waiting to be flushed
+	std::vector<uint8_t> flush; // frame being sent to the display
+	std::vector<uint32_t> drawTiles; // tiles drawn on since the last commit
+	std::vector<uint32_t> pendingTiles; // tiles changed since the last flush
+	std::vector<uint32_t> flushTiles;
+	bool dirty = false;
+	unsigned int flushed = 0; // number of frames sent to the display
+	uint64_t pendingStamp = 0; // when render.cpp sent the message that produced the pending frame
+	uint64_t flushStamp = 0;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::thread thread;
+};
+std::vector<std::unique_ptr<Framebuffer>> gFramebuffers;
+
+// --dump <dir> [pbm|png]: write every flushed frame to disk
+std::string gDumpDir;
+std::string gDumpFormat = "png";
+// --record <file>: log every incoming OSC message, so that it can later be
+// fed back through parseMessage() with --replay <file>
+FILE* gRecordFile = nullptr;
+// all displays (and the mux, if any) share the same bus
+std::mutex gI2cBusMutex;
+
+// Counters and timings, accumulated over gStatsLogInterval seconds and then
+// printed and reset. Send /stats [port] to get the current ones printed and
+// sent back as /stats/reply to the sender on port (default gStatsReplyPort).
+struct Stats
+{
+	unsigned int messages = 0;
+	unsigned int errors = 0; // messages we could not parse
+	unsigned int lost = 0; // gaps in the sequence numbers stamped by render.cpp
+	unsigned int frames = 0; // frames drawn
+	unsigned int coalesced = 0; // frames replaced by a newer one before being flushed
+	unsigned int flushes = 0; // frames sent to the displays
+	uint64_t bytes = 0; // framebuffer bytes sent to the displays
+	double draw = 0; // seconds spent drawing
+	double drawMax = 0;
+	double flush = 0; // seconds spent on the I2C bus
+	double flushMax = 0;
+	double latency = 0; // from render.cpp sending the message to the end of the flush
+	double latencyMax = 0;
+	unsigned int latencyCount = 0;
+	double start = 0;
+};
+Stats gStats;
+std::mutex gStatsMutex;
+const double gStatsLogInterval = 10;
+const int gStatsReplyPort = 7563;
+// --verbose: print every message received
+bool gVerbose = false;
+uint32_t gLastSequence = 0;
+bool gSequenceValid = false;
+
 unsigned int gActiveTarget = 0;
 const int gLocalPort = 7562; //port for incoming OSC messages
 
@@ -112,6 +213,7 @@ const int gLocalPort = 7562; //port for incoming OSC messages
 #include "TCA9548A.h"
 const unsigned int gMuxAddress = 0x70;
 TCA9548A gTca;
+int gSelectedMux = -1;
 #endif // I2C_MUX
 
 /// Determines how to select which display a message is targeted to:
@@ -122,8 +224,23 @@ typedef enum {
 } TargetMode;
 
 TargetMode gTargetMode = kTargetSingle; // can be changed with /targetMode
+
+// Live data received from render.cpp in /stream messages:
+// /stream <inPeak> <outPeak> <loopPosition> <firstColumn> <blob>
+// where the blob contains one (min, max) int8 pair per waveform column,
+// starting from column number firstColumn.
+enum { kWaveformColumns = 128 };
+const float kMeterFloorDb = -48;
+struct StreamState
+{
+	float inPeak = 0;
+	float outPeak = 0;
+	float loopPosition = -1; ///< between 0 and 1, or negative if the looper is not running
+	int8_t columns[kWaveformColumns][2] = {};
+	uint32_t nextColumn = 0; ///< number of the next column we expect
+} gStream;
 OscReceiver oscReceiver;
-int gStop = 0;
+std::atomic<int> gStop(0);
 
 // Handle Ctrl-C by requesting that the audio rendering stop
 void interrupt_handler(int var)
@@ -133,23 +250,490 @@ void interrupt_handler(int var)
 
 static void switchTarget(int target)
 {
-#ifdef I2C_MUX
-	if(target >= gDisplays.size())
+	// the mux is selected by the worker when the frame is flushed
+	gActiveTarget = target;
+}
+
+// call with gI2cBusMutex held (or before the workers are started)
+static void selectMux(int mux)
+{
+#if defined(I2C_MUX) && !defined(OLED_HEADLESS)
+	if(gSelectedMux != mux)
+	{
+		gTca.select(mux);
+		gSelectedMux = mux;
+	}
+#endif // I2C_MUX && !OLED_HEADLESS
+}
+
+static void setupFramebuffer(unsigned int target)
+{
+	U8G2& u8g2 = gDisplays[target].d;
+	size_t size = 8 * u8g2.getBufferTileWidth() * u8g2.getBufferTileHeight();
+	gFramebuffers.emplace_back(new Framebuffer);
+	Framebuffer& fb = *gFramebuffers.back();
+	fb.draw.resize(size);
+	fb.pending.resize(size);
+	fb.flush.resize(size);
+	fb.drawTiles.resize(u8g2.getBufferTileHeight());
+	fb.pendingTiles.resize(u8g2.getBufferTileHeight());
+	fb.flushTiles.resize(u8g2.getBufferTileHeight());
+	// the u8g2 setup functions use a static buffer which is shared by all
+	// displays of the same type: give each display its own instead
+	u8g2.getU8g2()->tile_buf_ptr = fb.draw.data();
+}
+
+static double getTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 0.000000001;
+}
+
+// record that the box at x, y of size w, h (in pixels) has been drawn on
+static void markTiles(unsigned int target, int x, int y, int w, int h)
+{
+	Framebuffer& fb = *gFramebuffers[target];
+	int tileWidth = gDisplays[target].d.getBufferTileWidth();
+	int firstColumn = std::max(0, x / 8);
+	int lastColumn = std::min(tileWidth - 1, (x + w - 1) / 8);
+	if(w <= 0 || h <= 0 || lastColumn < firstColumn)
+		return;
+	uint32_t mask = uint32_t((uint64_t(1) << (lastColumn + 1)) - (uint64_t(1) << firstColumn));
+	for(int row = std::max(0, y / 8); row <= (y + h - 1) / 8 && row < int(fb.drawTiles.size()); ++row)
+		fb.drawTiles[row] |= mask;
+}
+
+// hand the frame just drawn to the display's worker. If full is false, only
+// the tiles marked with markTiles() are flushed
+static void commitFrame(unsigned int target, uint64_t stamp = 0, bool full = true)
+{
+	Framebuffer& fb = *gFramebuffers[target];
+	if(full)
+	{
+		U8G2& u8g2 = gDisplays[target].d;
+		markTiles(target, 0, 0, 8 * u8g2.getBufferTileWidth(), 8 * u8g2.getBufferTileHeight());
+	}
+	bool coalesced;
+	{
+		std::lock_guard<std::mutex> lock(fb.mutex);
+		memcpy(fb.pending.data(), fb.draw.data(), fb.draw.size());
+		// a frame that replaces one not yet flushed also has to send what
+		// that one changed
+		for(unsigned int row = 0; row < fb.drawTiles.size(); ++row)
+		{
+			fb.pendingTiles[row] |= fb.drawTiles[row];
+			fb.drawTiles[row] = 0;
+		}
+		coalesced = fb.dirty;
+		// keep the oldest stamp, so that the latency includes the time
+		// the replaced frame spent waiting
+		if(!coalesced || !fb.pendingStamp)
+			fb.pendingStamp = stamp;
+		fb.dirty = true;
+	}
+	fb.cv.notify_one();
+	std::lock_guard<std::mutex> lock(gStatsMutex);
+	++gStats.frames;
+	gStats.coalesced += coalesced;
+}
+
+// u8g2 full buffers for the SSD1306 are made of 8-pixel-high tile rows,
+// with one byte per column and the topmost pixel in the LSB
+static bool getPixel(const std::vector<uint8_t>& frame, unsigned int width, unsigned int x, unsigned int y)
+{
+	return frame[(y / 8) * width + x] & (1 << (y & 7));
+}
+
+// pack the frame in rows of 1-bit pixels, MSB first, as used by PBM and PNG
+static std::vector<uint8_t> packRows(const std::vector<uint8_t>& frame, unsigned int width, unsigned int height, bool litValue, bool filterByte)
+{
+	unsigned int stride = (width + 7) / 8 + filterByte;
+	std::vector<uint8_t> rows(stride * height, 0);
+	for(unsigned int y = 0; y < height; ++y)
+	{
+		uint8_t* row = rows.data() + y * stride + filterByte;
+		for(unsigned int x = 0; x < width; ++x)
+		{
+			if(getPixel(frame, width, x, y) == litValue)
+				row[x / 8] |= 0x80 >> (x & 7);
+		}
+	}
+	return rows;
+}
+
+static uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+	crc = ~crc;
+	for(size_t n = 0; n < size; ++n)
+	{
+		crc ^= data[n];
+		for(unsigned int k = 0; k < 8; ++k)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void appendBigEndian(std::vector<uint8_t>& out, uint32_t value)
+{
+	for(int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(value >> shift);
+}
+
+static void appendPngChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data)
+{
+	appendBigEndian(out, data.size());
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	appendBigEndian(out, crc32(out.data() + start, out.size() - start));
+}
+
+// A 1-bit grayscale PNG. The image data is stored in uncompressed deflate
+// blocks, so that we don't need zlib.
+static std::vector<uint8_t> encodePng(const std::vector<uint8_t>& frame, unsigned int width, unsigned int height)
+{
+	std::vector<uint8_t> raw = packRows(frame, width, height, true, true); // lit pixels are white
+	std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	std::vector<uint8_t> ihdr;
+	appendBigEndian(ihdr, width);
+	appendBigEndian(ihdr, height);
+	ihdr.insert(ihdr.end(), {1, 0, 0, 0, 0}); // bit depth, grayscale, deflate, no filter, no interlace
+	appendPngChunk(png, "IHDR", ihdr);
+	std::vector<uint8_t> idat = {0x78, 0x01};
+	uint32_t a = 1;
+	uint32_t b = 0;
+	for(size_t start = 0; start < raw.size() || !start; start += 65535)
+	{
+		size_t len = std::min<size_t>(65535, raw.size() - start);
+		bool last = start + len >= raw.size();
+		idat.push_back(last);
+		idat.insert(idat.end(), {uint8_t(len), uint8_t(len >> 8), uint8_t(~len), uint8_t(~len >> 8)});
+		idat.insert(idat.end(), raw.begin() + start, raw.begin() + start + len);
+		for(size_t n = start; n < start + len; ++n)
+		{
+			a = (a + raw[n]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	appendBigEndian(idat, (b << 16) | a);
+	appendPngChunk(png, "IDAT", idat);
+	appendPngChunk(png, "IEND", {});
+	return png;
+}
+
+static void dumpFrame(unsigned int target, unsigned int frameNumber, const std::vector<uint8_t>& frame, unsigned int width, unsigned int height)
+{
+	std::vector<uint8_t> data;
+	if("pbm" == gDumpFormat)
+	{
+		std::string header = "P4\n" + std::to_string(width) + " " + std::to_string(height) + "\n";
+		data.assign(header.begin(), header.end());
+		std::vector<uint8_t> rows = packRows(frame, width, height, false, false); // in PBM 1 is black
+		data.insert(data.end(), rows.begin(), rows.end());
+	} else
+		data = encodePng(frame, width, height);
+	char name[32];
+	snprintf(name, sizeof(name), "/display%u_%06u.", target, frameNumber);
+	std::string path = gDumpDir + name + gDumpFormat;
+	FILE* f = fopen(path.c_str(), "wb");
+	if(!f)
+	{
+		fprintf(stderr, "Unable to open %s\n", path.c_str());
 		return;
+	}
+	fwrite(data.data(), 1, data.size(), f);
+	fclose(f);
+}
+
+// call with gI2cBusMutex held and the display's mux selected
+static void flushFrame(unsigned int target)
+{
+	Framebuffer& fb = *gFramebuffers[target];
+	{
+		std::lock_guard<std::mutex> lock(fb.mutex);
+		if(!fb.dirty)
+			return;
+		std::swap(fb.pending, fb.flush);
+		std::swap(fb.pendingTiles, fb.flushTiles);
+		std::fill(fb.pendingTiles.begin(), fb.pendingTiles.end(), 0);
+		fb.flushStamp = fb.pendingStamp;
+		fb.pendingStamp = 0;
+		fb.dirty = false;
+	}
 	U8G2& u8g2 = gDisplays[target].d;
+	unsigned int tileWidth = u8g2.getBufferTileWidth();
+	unsigned int tileHeight = u8g2.getBufferTileHeight();
+	if(gDumpDir.size())
+		dumpFrame(target, fb.flushed, fb.flush, tileWidth * 8, tileHeight * 8);
+	++fb.flushed;
+	double start = getTime();
+	unsigned int tiles = 0;
+#ifndef OLED_HEADLESS
+	// like u8g2.sendBuffer(), but from our own buffer and only the runs of
+	// changed tiles on each row
+	u8x8_t* u8x8 = u8g2.getU8x8();
+#endif // OLED_HEADLESS
+	for(unsigned int row = 0; row < tileHeight; ++row)
+	{
+		uint32_t mask = fb.flushTiles[row];
+		for(unsigned int column = 0; column < tileWidth; )
+		{
+			if(!(mask & (1u << column)))
+			{
+				++column;
+				continue;
+			}
+			unsigned int count = 0;
+			while(column + count < tileWidth && (mask & (1u << (column + count))))
+				++count;
+#ifndef OLED_HEADLESS
+			u8x8_DrawTile(u8x8, column, row, count, fb.flush.data() + (row * tileWidth + column) * 8);
+#endif // OLED_HEADLESS
+			tiles += count;
+			column += count;
+		}
+	}
+#ifndef OLED_HEADLESS
+	u8x8_RefreshDisplay(u8x8);
+#endif // OLED_HEADLESS
+	double end = getTime();
+	std::lock_guard<std::mutex> lock(gStatsMutex);
+	++gStats.flushes;
+	gStats.bytes += tiles * 8;
+	gStats.flush += end - start;
+	gStats.flushMax = std::max(gStats.flushMax, end - start);
+	if(fb.flushStamp)
+	{
+		// render.cpp stamps with the same clock
+		double latency = end - fb.flushStamp * 0.000001;
+		gStats.latency += latency;
+		gStats.latencyMax = std::max(gStats.latencyMax, latency);
+		++gStats.latencyCount;
+	}
+}
+
+static void displayWorker(unsigned int target)
+{
+	Framebuffer& fb = *gFramebuffers[target];
 	int mux = gDisplays[target].mux;
-	static int oldMux = -1;
-	if(oldMux != mux)
-		gTca.select(mux);
-	oldTarget = target;
-#endif // I2C_MUX
-	gActiveTarget = target;
+	while(!gStop)
+	{
+		{
+			std::unique_lock<std::mutex> lock(fb.mutex);
+			fb.cv.wait(lock, [&fb]{ return fb.dirty || gStop; });
+		}
+		if(gStop)
+			break;
+		std::lock_guard<std::mutex> busLock(gI2cBusMutex);
+		selectMux(mux);
+		flushFrame(target);
+		// while the mux is on our channel, also flush any other display
+		// behind it, so that the mux is switched once per round
+		for(unsigned int n = 0; n < gDisplays.size(); ++n)
+		{
+			if(n != target && gDisplays[n].mux == mux)
+				flushFrame(n);
+		}
+	}
+}
+
+static void receiveColumns(uint32_t firstColumn, const std::vector<char>& blob)
+{
+	unsigned int numColumns = blob.size() / 2;
+	// columns lost in transit (or before we started) are drawn as silence
+	while(gStream.nextColumn < firstColumn && firstColumn - gStream.nextColumn <= kWaveformColumns)
+	{
+		int8_t* column = gStream.columns[gStream.nextColumn++ % kWaveformColumns];
+		column[0] = column[1] = 0;
+	}
+	gStream.nextColumn = firstColumn;
+	for(unsigned int n = 0; n < numColumns; ++n)
+	{
+		int8_t* column = gStream.columns[gStream.nextColumn++ % kWaveformColumns];
+		column[0] = blob[2 * n];
+		column[1] = blob[2 * n + 1];
+	}
+}
+
+static int meterHeight(float peak, int height)
+{
+	if(peak <= 0)
+		return 0;
+	float norm = (20.f * log10f(peak) - kMeterFloorDb) / -kMeterFloorDb;
+	norm = std::min(1.f, std::max(0.f, norm));
+	return norm * height + 0.5f;
+}
+
+static void clearBox(U8G2& u8g2, int x, int y, int w, int h)
+{
+	u8g2.setDrawColor(0);
+	u8g2.drawBox(x, y, w, h);
+	u8g2.setDrawColor(1);
+}
+
+const int kMeterWidth = 2;
+
+static void drawMeters(U8G2& u8g2)
+{
+	int w = u8g2.getDisplayWidth();
+	int h = u8g2.getDisplayHeight();
+	const int meterWidth = kMeterWidth;
+	clearBox(u8g2, 0, 0, meterWidth, h);
+	clearBox(u8g2, w - meterWidth, 0, meterWidth, h);
+	int in = meterHeight(gStream.inPeak, h);
+	int out = meterHeight(gStream.outPeak, h);
+	if(in)
+		u8g2.drawBox(0, h - in, meterWidth, in);
+	if(out)
+		u8g2.drawBox(w - meterWidth, h - out, meterWidth, out);
+}
+
+static void drawWaveform(U8G2& u8g2, int x, int y, int w, int h)
+{
+	clearBox(u8g2, x, y, w, h);
+	int center = y + h / 2;
+	float scale = (h / 2) / 127.f;
+	// the newest column is on the right
+	for(int n = 0; n < w && n < kWaveformColumns; ++n)
+	{
+		const int8_t* column = gStream.columns[(gStream.nextColumn - w + n) % kWaveformColumns];
+		int top = center - int(column[1] * scale);
+		int bottom = center - int(column[0] * scale);
+		u8g2.drawVLine(x + n, top, std::max(1, bottom - top + 1));
+	}
+}
+
+static void drawLoopPosition(U8G2& u8g2, int x, int y, int w, int h)
+{
+	clearBox(u8g2, x, y, w, h);
+	u8g2.drawFrame(x, y, w, h);
+	if(gStream.loopPosition >= 0)
+		u8g2.drawBox(x + 1, y + 1, (w - 2) * gStream.loopPosition, h - 2);
+}
+
+static void drawOverlay(unsigned int target)
+{
+	Display& display = gDisplays[target];
+	U8G2& u8g2 = display.d;
+	int w = u8g2.getDisplayWidth();
+	int h = u8g2.getDisplayHeight();
+	if(kOverlayNone == display.overlay)
+		return;
+	drawMeters(u8g2);
+	markTiles(target, 0, 0, kMeterWidth, h);
+	markTiles(target, w - kMeterWidth, 0, kMeterWidth, h);
+	if(kOverlayLooper == display.overlay)
+	{
+		drawWaveform(u8g2, 4, 13, w - 8, 24);
+		markTiles(target, 4, 13, w - 8, 24);
+		drawLoopPosition(u8g2, 4, h - 8, w - 8, 6);
+		markTiles(target, 4, h - 8, w - 8, 6);
+	}
+}
+
+// records are stored as a RecordHeader followed by the raw OSC packet
+struct RecordHeader
+{
+	uint32_t size;
+	uint32_t reserved;
+	double time; // seconds since the recording started
+};
+
+// print the stats gathered since the last reset and optionally send them to
+// replyAddress:replyPort
+static void reportStats(bool reset, const char* replyAddress = nullptr, int replyPort = 0)
+{
+	Stats st;
+	double now = getTime();
+	{
+		std::lock_guard<std::mutex> lock(gStatsMutex);
+		st = gStats;
+		if(reset)
+		{
+			gStats = Stats();
+			gStats.start = now;
+		}
+	}
+	double elapsed = std::max(0.001, now - st.start);
+	float drawMean = st.frames ? st.draw / st.frames * 1000 : 0;
+	float flushMean = st.flushes ? st.flush / st.flushes * 1000 : 0;
+	float latencyMean = st.latencyCount ? st.latency / st.latencyCount * 1000 : 0;
+	float fps = st.flushes / elapsed;
+	float busLoad = st.flush / elapsed * 100;
+	float bytesPerSecond = st.bytes / elapsed;
+	printf("OLED: %u messages (%u lost, %u errors), %u frames (%u coalesced), %.1f fps, "
+		"draw %.2f/%.2f ms, flush %.2f/%.2f ms, I2C %.0f%% %.0f B/s, latency %.1f/%.1f ms\n",
+		st.messages, st.lost, st.errors, st.frames, st.coalesced, fps,
+		drawMean, st.drawMax * 1000, flushMean, st.flushMax * 1000,
+		busLoad, bytesPerSecond, latencyMean, st.latencyMax * 1000);
+	if(!replyAddress)
+		return;
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(replyPort);
+	if(1 != inet_pton(AF_INET, replyAddress, &addr.sin_addr))
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	oscpkt::Message reply("/stats/reply");
+	reply.pushInt32(st.messages).pushInt32(st.lost).pushInt32(st.errors)
+		.pushInt32(st.frames).pushInt32(st.coalesced).pushFloat(fps)
+		.pushFloat(drawMean).pushFloat(st.drawMax * 1000)
+		.pushFloat(flushMean).pushFloat(st.flushMax * 1000)
+		.pushFloat(busLoad).pushFloat(bytesPerSecond)
+		.pushFloat(latencyMean).pushFloat(st.latencyMax * 1000);
+	oscpkt::PacketWriter writer;
+	writer.addMessage(reply);
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock < 0)
+		return;
+	sendto(sock, writer.packetData(), writer.packetSize(), 0, (struct sockaddr*)&addr, sizeof(addr));
+	close(sock);
+}
+
+static void recordMessage(const oscpkt::Message& msg)
+{
+	static double startTime = getTime();
+	oscpkt::PacketWriter writer;
+	writer.addMessage(msg);
+	RecordHeader h = {
+		.size = uint32_t(writer.packetSize()),
+		.reserved = 0,
+		.time = getTime() - startTime,
+	};
+	fwrite(&h, sizeof(h), 1, gRecordFile);
+	fwrite(writer.packetData(), 1, h.size, gRecordFile);
 }
 
 int parseMessage(oscpkt::Message msg, const char* address, void*)
 {
+	if(gRecordFile)
+		recordMessage(msg);
 
 	oscpkt::Message::ArgReader args = msg.arg();
+	// messages from render.cpp start with a blob holding the time they were
+	// sent and a sequence number
+	uint64_t stamp = 0;
+	if(args.isBlob())
+	{
+		std::vector<char> blob;
+		uint32_t sequence;
+		args.popBlob(blob);
+		if(blob.size() == sizeof(stamp) + sizeof(sequence))
+		{
+			memcpy(&stamp, blob.data(), sizeof(stamp));
+			memcpy(&sequence, blob.data() + sizeof(stamp), sizeof(sequence));
+			std::lock_guard<std::mutex> lock(gStatsMutex);
+			// a large jump backwards means render.cpp has restarted
+			if(gSequenceValid && sequence - gLastSequence - 1 < 0x10000)
+				gStats.lost += sequence - gLastSequence - 1;
+			gLastSequence = sequence;
+			gSequenceValid = true;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(gStatsMutex);
+		++gStats.messages;
+	}
 	enum {
 		kOk = 0,
 		kUnmatchedPattern,
@@ -157,7 +741,9 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 		kInvalidMode,
 		kOutOfRange,
 	} error = kOk;
-	printf("Message from %s\n", address);
+	bool streamMessage = msg.match("/stream");
+	if(!streamMessage && gVerbose)
+		printf("Message from %s\n", address);
 	bool stateMessage = false;
 	// check state (non-display) messages first
 	if (msg.match("/target")) {
@@ -175,6 +761,13 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 				error = kWrongArguments;
 			}
 		}
+	} else if (msg.match("/stats")) {
+		stateMessage = true;
+		int port = gStatsReplyPort;
+		if(args.isOkNoMoreArgs() || args.popNumber(port).isOkNoMoreArgs())
+			reportStats(false, address, port);
+		else
+			error = kWrongArguments;
 	} else if (msg.match("/targetMode")) {
 		stateMessage = true;
 		int mode;
@@ -189,15 +782,6 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 		} else
 			error = kWrongArguments;
 	}
-	if(gActiveTarget >= gDisplays.size())
-	{
-		fprintf(stderr, "Target %u out of range. Only %u displays are available\n", gActiveTarget, gDisplays.size());
-		return 1;
-	}
-	U8G2& u8g2 = gDisplays[gActiveTarget].d;
-	u8g2.clearBuffer();
-	int displayWidth = u8g2.getDisplayWidth();
-	int displayHeight = u8g2.getDisplayHeight();
 	if(!stateMessage && kTargetEach == gTargetMode)
 	{
 		// if we are in kTargetEach and the message is for a display, we need to peel off the
@@ -211,11 +795,45 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 			error = kWrongArguments;
 		}
 	}
+	if(gActiveTarget >= gDisplays.size())
+	{
+		fprintf(stderr, "Target %u out of range. Only %u displays are available\n", gActiveTarget, gDisplays.size());
+		std::lock_guard<std::mutex> lock(gStatsMutex);
+		++gStats.errors;
+		return 1;
+	}
+	unsigned int target = gActiveTarget;
+	Display& display = gDisplays[target];
+	U8G2& u8g2 = display.d;
+	double start = getTime();
+	// /stream only redraws the overlay on top of the current page
+	if(!stateMessage && !streamMessage)
+	{
+		u8g2.clearBuffer();
+		display.overlay = kOverlayMeters;
+	}
+	int displayWidth = u8g2.getDisplayWidth();
+	int displayHeight = u8g2.getDisplayHeight();
 
 	// code below MUST use msg.match() to check patterns and args.pop... or args.is ... to check message content.
 	// this way, anything popped above (if we are in kTargetEach mode), won't be re-used below
 	if(error || stateMessage) {
 		// nothing to do here, just avoid matching any of the others
+	} else if (streamMessage)
+	{
+		float inPeak;
+		float outPeak;
+		float loopPosition;
+		int firstColumn;
+		std::vector<char> blob;
+		if(args.popNumber(inPeak).popNumber(outPeak).popNumber(loopPosition).popNumber(firstColumn).popBlob(blob).isOkNoMoreArgs())
+		{
+			gStream.inPeak = inPeak;
+			gStream.outPeak = outPeak;
+			gStream.loopPosition = loopPosition;
+			receiveColumns(firstColumn, blob);
+		} else
+			error = kWrongArguments;
 	} else if (msg.match("/scanner_vibrato"))
 	{
 		int number1;
@@ -226,7 +844,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /scanner_vibrato %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /scanner_vibrato %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.1015, displayHeight * 0, "[SCANNER_VIBRATO]");
 			
@@ -259,7 +878,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /tape_delay_1 %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /tape_delay_1 %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -292,7 +912,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /tape_delay_2 %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /tape_delay_2 %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -325,7 +946,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /freeverb %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /freeverb %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.265, displayHeight * 0, "[FREEVERB]");
 			
@@ -356,14 +978,16 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /looper %d\n", number1);
+			if(gVerbose)
+				printf("received /looper %d\n", number1);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.31, displayHeight * 0, "[LOOPER]");
 			
-			
-		    u8g2.drawStr(displayWidth * 0.33, displayHeight * 0.40, "[     ]");
-			u8g2.drawUTF8(displayWidth * 0.41, displayHeight * 0.40, std::to_string(number1).c_str());
-			u8g2.drawStr(displayWidth * 0.33, displayHeight * 0.60, "[level]");
+			// the waveform and position bar are drawn by drawOverlay()
+			display.overlay = kOverlayLooper;
+			u8g2.drawStr(displayWidth * 0.1, displayHeight * 0.62, "[level]");
+		    u8g2.drawStr(displayWidth * 0.61, displayHeight * 0.62, "[     ]");
+			u8g2.drawUTF8(displayWidth * 0.69, displayHeight * 0.62, std::to_string(number1).c_str());
 			
 			
 
@@ -387,7 +1011,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /d/w_scn_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /d/w_scn_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.1015, displayHeight * 0, "[SCANNER_VIBRATO]");
 			
@@ -420,7 +1045,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /scanner_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /scanner_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.1015, displayHeight * 0, "[SCANNER_VIBRATO]");
 			
@@ -454,7 +1080,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /rate_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /rate_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.1015, displayHeight * 0, "[SCANNER_VIBRATO]");
 			
@@ -489,7 +1116,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /depth_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /depth_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.1015, displayHeight * 0, "[SCANNER_VIBRATO]");
 			
@@ -527,7 +1155,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /d/w_del_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /d/w_del_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -560,7 +1189,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /delay_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /delay_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -593,7 +1223,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /deltime_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /deltime_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -628,7 +1259,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /feedback_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /feedback_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -666,7 +1298,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /d/w_del_2_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /d/w_del_2_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -699,7 +1332,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /delay_2_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /delay_2_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -733,7 +1367,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /ramptime_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /ramptime_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -768,7 +1403,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /rolloff_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /rolloff_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.225, displayHeight * 0, "[TAPE_DELAY]");
 			
@@ -805,7 +1441,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /d/w_rev_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /d/w_rev_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.265, displayHeight * 0, "[FREEVERB]");
 			
@@ -838,7 +1475,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /reverb_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /reverb_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.265, displayHeight * 0, "[FREEVERB]");
 			
@@ -872,7 +1510,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /revtime_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /revtime_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.265, displayHeight * 0, "[FREEVERB]");
 			
@@ -907,7 +1546,8 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 
 		{
 
-			printf("received /damping_exp %d %d %d %d\n", number1 ,number2, number3, number4);
+			if(gVerbose)
+				printf("received /damping_exp %d %d %d %d\n", number1 ,number2, number3, number4);
 			u8g2.setFont(u8g2_font_6x12_tf);
 			u8g2.drawStr(displayWidth * 0.265, displayHeight * 0, "[FREEVERB]");
 			
@@ -940,7 +1580,9 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 			error = kWrongArguments;
 		}
 		else {
-			printf("received /desel_oled\n");
+			if(gVerbose)
+				printf("received /desel_oled\n");
+			display.overlay = kOverlayNone;
 		u8g2.setFont(u8g2_font_4x6_tf);
 		u8g2.setFontRefHeightText();
 		u8g2.setFontPosTop();
@@ -977,41 +1619,133 @@ int parseMessage(oscpkt::Message msg, const char* address, void*)
 				break;
 		}
 		fprintf(stderr, "An error occurred with message to: %s: %s\n", msg.addressPattern().c_str(), str.c_str());
+		std::lock_guard<std::mutex> lock(gStatsMutex);
+		++gStats.errors;
 		return 1;
 	} else
 	{
-		if(!stateMessage)
-			u8g2.sendBuffer();
+		// a /stream message with no overlay to draw leaves the frame as it is
+		if(!stateMessage && !(streamMessage && kOverlayNone == display.overlay))
+		{
+			drawOverlay(target);
+			double drawTime = getTime() - start;
+			{
+				std::lock_guard<std::mutex> lock(gStatsMutex);
+				gStats.draw += drawTime;
+				gStats.drawMax = std::max(gStats.drawMax, drawTime);
+			}
+			commitFrame(target, stamp, !streamMessage);
+		}
+	}
+	return 0;
+}
+
+// Feed a recording made with --record through parseMessage(), as fast as
+// possible, flushing each frame right away. Prints how long drawing and
+// flushing took for each message address.
+static int replay(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if(!f)
+	{
+		fprintf(stderr, "Unable to open %s\n", path);
+		return 1;
+	}
+	struct Cost {
+		unsigned int count = 0;
+		double draw = 0;
+		double drawMax = 0;
+		double flush = 0;
+	};
+	std::map<std::string, Cost> costs;
+	RecordHeader h;
+	std::vector<char> packet;
+	while(1 == fread(&h, sizeof(h), 1, f))
+	{
+		packet.resize(h.size);
+		if(h.size != fread(packet.data(), 1, h.size, f))
+			break;
+		oscpkt::PacketReader reader(packet.data(), packet.size());
+		oscpkt::Message* msg;
+		while(reader.isOk() && (msg = reader.popMessage()))
+		{
+			double start = getTime();
+			parseMessage(*msg, path, nullptr);
+			double drawn = getTime();
+			for(unsigned int n = 0; n < gDisplays.size(); ++n)
+				flushFrame(n);
+			Cost& c = costs[msg->addressPattern()];
+			++c.count;
+			c.draw += drawn - start;
+			c.drawMax = std::max(c.drawMax, drawn - start);
+			c.flush += getTime() - drawn;
+		}
+	}
+	fclose(f);
+	printf("%-20s %8s %10s %10s %10s\n", "address", "count", "draw(us)", "max(us)", "flush(us)");
+	for(auto& c : costs)
+	{
+		printf("%-20s %8u %10.1f %10.1f %10.1f\n", c.first.c_str(), c.second.count,
+			c.second.draw / c.second.count * 1000000,
+			c.second.drawMax * 1000000,
+			c.second.flush / c.second.count * 1000000);
 	}
 	return 0;
 }
 
 int main(int main_argc, char *main_argv[])
 {
+	const char* replayPath = nullptr;
+	for(int n = 1; n < main_argc; ++n)
+	{
+		std::string arg = main_argv[n];
+		if("--dump" == arg && n + 1 < main_argc)
+		{
+			gDumpDir = main_argv[++n];
+			if(n + 1 < main_argc && (0 == strcmp(main_argv[n + 1], "png") || 0 == strcmp(main_argv[n + 1], "pbm")))
+				gDumpFormat = main_argv[++n];
+		} else if("--record" == arg && n + 1 < main_argc) {
+			gRecordFile = fopen(main_argv[++n], "wb");
+			if(!gRecordFile)
+			{
+				fprintf(stderr, "Unable to open %s\n", main_argv[n]);
+				return 1;
+			}
+		} else if("--replay" == arg && n + 1 < main_argc) {
+			replayPath = main_argv[++n];
+		} else if("--verbose" == arg) {
+			gVerbose = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--dump <dir> [png|pbm]] [--record <file>] [--replay <file>] [--verbose]\n", main_argv[0]);
+			return 1;
+		}
+	}
 	if(0 == gDisplays.size())
 	{
 		fprintf(stderr, "No displays in gDisplays\n");
 		return 1;
 	}
-#ifdef I2C_MUX
+#if defined(I2C_MUX) && !defined(OLED_HEADLESS)
 	if(gTca.initI2C_RW(gI2cBus, gMuxAddress, -1) || gTca.select(-1))
 	{
 		fprintf(stderr, "Unable to initialise the TCA9548A multiplexer. Are the address and bus correct?\n");
 		return 1;
 	}
-#endif // I2C_MUX
+#endif // I2C_MUX && !OLED_HEADLESS
 	for(unsigned int n = 0; n < gDisplays.size(); ++n)
 	{
 		switchTarget(n);
 		U8G2& u8g2 = gDisplays[gActiveTarget].d;
-#ifndef I2C_MUX
 		int mux = gDisplays[gActiveTarget].mux;
+#ifndef I2C_MUX
 		if(-1 != mux)
 		{
 			fprintf(stderr, "Display %u requires mux %d but I2C_MUX is disabled\n", n, mux);
 			return 1;
 		}
 #endif // I2C_MUX
+		setupFramebuffer(n);
+		selectMux(mux);
 		u8g2.initDisplay();
 		u8g2.setPowerSave(0);
 		u8g2.clearBuffer();
@@ -1028,16 +1762,38 @@ int main(int main_argc, char *main_argv[])
 			std::string targetString = "Target ID: " + std::to_string(n);
 			u8g2.drawStr(0, 50, targetString.c_str());
 		}
-		u8g2.sendBuffer();
+		commitFrame(n);
 	}
+	switchTarget(0);
+	if(replayPath)
+		return replay(replayPath);
+	for(unsigned int n = 0; n < gDisplays.size(); ++n)
+		gFramebuffers[n]->thread = std::thread(displayWorker, n);
 	// Set up interrupt handler to catch Control-C and SIGTERM
 	signal(SIGINT, interrupt_handler);
 	signal(SIGTERM, interrupt_handler);
 	// OSC
+	double lastReport = gStats.start = getTime();
 	oscReceiver.setup(gLocalPort, parseMessage);
 	while(!gStop)
 	{
 		usleep(100000);
+		if(getTime() - lastReport >= gStatsLogInterval)
+		{
+			reportStats(true);
+			lastReport = getTime();
+		}
+	}
+	for(auto& fb : gFramebuffers)
+	{
+		{
+			// take the lock so that the worker cannot miss the notification
+			std::lock_guard<std::mutex> lock(fb->mutex);
+		}
+		fb->cv.notify_one();
+		fb->thread.join();
 	}
+	if(gRecordFile)
+		fclose(gRecordFile);
 	return 0;
 }